@@ -0,0 +1,85 @@
+// Microbenchmark for output file creation: the old path (full path built with an
+// ostringstream, written with std::ofstream) against the current one (name formatted
+// with std::to_chars, openat on an open directory fd, plain write(2)).
+//
+// Build with `make bench/create_files`, then run:
+//   bench/create_files [directory] [files] [size]
+// It creates its files under directory/create_files_bench and removes them afterwards.
+
+#include <charconv>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+// Function to create count files the way saveEmail did before directory fds
+double createWithOfstream(const std::string& root, int count, const std::string& data) {
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < count; ++i) {
+    std::ostringstream name;
+    name << 1700000000 + i << ".M" << i << "_mbox2eml:2,S.eml";
+    std::string path = root + "/" + "cur/" + name.str();
+    std::ofstream file(path, std::ios::binary);
+    file.write(data.data(), data.size());
+  }
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Function to create count files relative to an open directory, as createFileAt does
+double createWithOpenat(const std::string& root, int count, const std::string& data) {
+  auto start = std::chrono::steady_clock::now();
+  int dir = open((root + "/cur").c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir < 0) {
+    throw std::runtime_error("Failed to open " + root + "/cur: " + strerror(errno));
+  }
+  const char suffix[] = "_mbox2eml:2,S.eml";
+  for (int i = 0; i < count; ++i) {
+    char name[64];
+    char* end = std::to_chars(name, name + 20, 1700000000 + i).ptr;
+    *end++ = '.';
+    *end++ = 'M';
+    end = std::to_chars(end, end + 20, i).ptr;
+    end = std::copy(suffix, suffix + sizeof(suffix) - 1, end);
+    *end = '\0';
+    int fd = openat(dir, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0 || write(fd, data.data(), data.size()) != static_cast<ssize_t>(data.size())) {
+      throw std::runtime_error(std::string("Failed to write ") + name + ": " + strerror(errno));
+    }
+    close(fd);
+  }
+  close(dir);
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char* argv[]) {
+  std::string directory = argc > 1 ? argv[1] : ".";
+  int count = argc > 2 ? std::stoi(argv[2]) : 20000;
+  std::string data(argc > 3 ? std::stoul(argv[3]) : 3000, 'x');
+  std::string root = directory + "/create_files_bench";
+
+  try {
+    // The first round warms up the directory and inode caches
+    for (int round = 0; round < 3; ++round) {
+      fs::remove_all(root);
+      fs::create_directories(root + "/ofstream/cur");
+      fs::create_directories(root + "/openat/cur");
+      double ofstream_seconds = createWithOfstream(root + "/ofstream", count, data);
+      double openat_seconds = createWithOpenat(root + "/openat", count, data);
+      std::cout << "ofstream: " << static_cast<long>(count / ofstream_seconds) << " files/s, openat: "
+                << static_cast<long>(count / openat_seconds) << " files/s" << std::endl;
+    }
+    fs::remove_all(root);
+  } catch (const std::exception& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
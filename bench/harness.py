@@ -0,0 +1,52 @@
+"""Shared helpers for the benchmark scripts: corpus generation and timed runs."""
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+
+def workspace(directory=None):
+    """Return a scratch directory (a new temporary one unless given)."""
+    if directory:
+        os.makedirs(directory, exist_ok=True)
+        return directory
+    return tempfile.mkdtemp(prefix="mbox2eml-bench-")
+
+
+def make_corpus(directory, *args):
+    """Generate an export with tests/corpus.py into directory, once."""
+    if not os.path.isdir(directory):
+        subprocess.run([sys.executable, os.path.join(ROOT, "tests", "corpus.py"), directory, *args], check=True)
+    return directory
+
+
+def drop_caches():
+    """Flush dirty pages, and drop the page cache when running as root on Linux."""
+    subprocess.run(["sync"], check=False)
+    try:
+        with open("/proc/sys/vm/drop_caches", "w") as f:
+            f.write("3\n")
+    except OSError:
+        pass
+
+
+def convert(binary, input_directory, output_directory, options):
+    """Run one conversion into a fresh output directory; return wall-clock seconds."""
+    shutil.rmtree(output_directory, ignore_errors=True)
+    drop_caches()
+    start = time.monotonic()
+    result = subprocess.run([binary, *options, input_directory, output_directory],
+                            stdout=subprocess.DEVNULL, stderr=subprocess.PIPE, text=True)
+    seconds = time.monotonic() - start
+    if result.returncode != 0:
+        sys.exit(f"mbox2eml {' '.join(options)} failed:\n{result.stderr}")
+    return seconds
+
+
+def best_of(runs, binary, input_directory, output_directory, options):
+    """Return the fastest of several conversions."""
+    return min(convert(binary, input_directory, output_directory, options) for _ in range(runs))
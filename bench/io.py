@@ -0,0 +1,45 @@
+#!/usr/bin/env python3
+"""Compare the output backends (--io-backend=uring|posix) at each --durability level.
+
+Converts an export of many small messages, which is dominated by file creation, and
+prints the best wall-clock time and file rate of each combination. Run it on the
+filesystem you care about (--work=DIR): durability timings mean little on tmpfs.
+
+Usage: bench/io.py [--binary=./mbox2eml] [--messages=5000] [--runs=3] [--work=DIR]
+"""
+import argparse
+import os
+
+import harness
+
+
+def count_files(directory):
+    return sum(len(files) for _, _, files in os.walk(directory))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--binary", default=os.path.join(harness.ROOT, "mbox2eml"))
+    parser.add_argument("--messages", type=int, default=5000, help="messages per chunk (2 chunks)")
+    parser.add_argument("--backends", default="uring,posix")
+    parser.add_argument("--durability", default="none,batched,strict")
+    parser.add_argument("--runs", type=int, default=3, help="runs per setting; the best is shown")
+    parser.add_argument("--work", help="scratch directory (default: a new temporary one)")
+    args = parser.parse_args()
+
+    work = harness.workspace(args.work)
+    corpus = harness.make_corpus(os.path.join(work, f"small-{args.messages}"), "--chunks=2",
+                                 f"--messages={args.messages}")
+    output = os.path.join(work, "out")
+
+    print(f"{'backend':>8} {'durability':>10} {'seconds':>8} {'files/s':>8}")
+    for backend in args.backends.split(","):
+        for durability in args.durability.split(","):
+            seconds = harness.best_of(args.runs, args.binary, corpus, output,
+                                      [f"--io-backend={backend}", f"--durability={durability}"])
+            files = count_files(output)
+            print(f"{backend:>8} {durability:>10} {seconds:>8.2f} {files / seconds:>8.0f}")
+
+
+if __name__ == "__main__":
+    main()
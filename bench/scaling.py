@@ -0,0 +1,39 @@
+#!/usr/bin/env python3
+"""Compare the work-stealing pool with --scheduler=static on a skewed export.
+
+Each chunk starts with a few messages carrying large attachments, so the first static
+slice holds most of the work. Prints the best wall-clock time of each scheduler at each
+thread count.
+
+Usage: bench/scaling.py [--binary=./mbox2eml] [--threads=1,2,4,8] [--runs=3] [--work=DIR]
+"""
+import argparse
+import os
+
+import harness
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--binary", default=os.path.join(harness.ROOT, "mbox2eml"))
+    parser.add_argument("--threads", default="1,2,4,8", help="comma-separated thread counts")
+    parser.add_argument("--runs", type=int, default=3, help="runs per setting; the best is shown")
+    parser.add_argument("--work", help="scratch directory (default: a new temporary one)")
+    args = parser.parse_args()
+
+    work = harness.workspace(args.work)
+    corpus = harness.make_corpus(os.path.join(work, "skewed"), "--chunks=2", "--messages=2000", "--big=4",
+                                 "--big-size=16777216", "--skew")
+    output = os.path.join(work, "out")
+
+    print(f"{'threads':>7} {'static s':>9} {'stealing s':>10} {'speedup':>8}")
+    for threads in (int(n) for n in args.threads.split(",")):
+        static = harness.best_of(args.runs, args.binary, corpus, output,
+                                 [f"--threads={threads}", "--scheduler=static", "--compress-bodies"])
+        stealing = harness.best_of(args.runs, args.binary, corpus, output,
+                                   [f"--threads={threads}", "--scheduler=stealing", "--compress-bodies"])
+        print(f"{threads:>7} {static:>9.2f} {stealing:>10.2f} {static / stealing:>7.2f}x")
+
+
+if __name__ == "__main__":
+    main()
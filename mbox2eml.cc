@@ -41,24 +41,77 @@
 #include <vector>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
+#include <deque>
 #include <filesystem>
 #include <algorithm>
 #include <regex>
 #include <sstream>
 #include <iomanip>
 #include <cstring>
+#include <charconv>
+#include <csignal>
 #include <chrono>
+#include <functional>
+#include <map>
 #include <random>
+#include <atomic>
+#include <exception>
+#include <string_view>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <unordered_map>
+#include <unordered_set>
+#include <set>
+#include <memory>
+#include <tuple>
+#include <optional>
+#include <strings.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <zlib.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+// The io_uring backend needs the kernel headers of Linux 5.19 or later, which define the
+// sparse registered file table; with older headers only the posix backend is built
+#if defined(IORING_RSRC_REGISTER_SPARSE) && defined(__NR_io_uring_setup)
+#define HAVE_IO_URING 1
+#endif
 
 namespace fs = std::filesystem;
 
+// Rules that decide whether an attachment is gzip-compressed or stored as-is
+enum CompressionRule {
+  kRuleExtension,    // stored: known compressed file extension
+  kRuleContentType,  // stored: known compressed MIME type
+  kRuleMagicBytes,   // stored: content starts with a compressed container signature
+  kRuleEntropy,      // stored: sampled content is too random to shrink
+  kRuleCompress,     // compressed with gzip
+  kNumCompressionRules
+};
+
+const char* const kCompressionRuleNames[kNumCompressionRules] = {
+  "extension", "content type", "magic bytes", "entropy", "compressed"
+};
+
+// How often each rule fired, reported at the end of the run
+std::atomic<long> compression_rule_counts[kNumCompressionRules];
+
 // Structure to hold attachment data
 struct Attachment {
   std::string filename;
   std::string content;
   std::string content_type;
+  CompressionRule compression_rule = kRuleCompress;  // Decided once when the attachment is extracted
+  std::string content_hash;  // Hex digest of the decoded bytes, set with --dedup-attachments, --pack,
+                             // --attachment-shards or --index
 };
 
 // Structure to hold email data
@@ -66,30 +119,342 @@ struct Email {
   std::string content;  // Email content with attachments stripped
   std::time_t timestamp;
   std::vector<Attachment> attachments;
+  std::vector<std::string> labels;  // Gmail labels, parsed with --label-folders
+  uint64_t source_offset = 0;  // Byte offset of the message in its chunk file
+  uint64_t source_size = 0;    // Size of the raw message in its chunk file
+  int number = 0;              // Global email number, assigned in file order while splitting
+  uint64_t fingerprint = 0;    // messageFingerprint, set with --incremental, or --label-folders
+                               // and --dedup-messages
+};
+
+// How saved files are made durable, set with --durability
+enum Durability {
+  kDurabilityNone,     // Leave writeback to the kernel
+  kDurabilityBatched,  // Sync each batch of messages as a group before journaling it
+  kDurabilityStrict,   // Sync each message on its own
+};
+
+// Command-line options
+struct Options {
+  bool use_dictionary = false;  // --dict: compress small bodies and text parts with a shared dictionary
+  bool compress_bodies = false; // --compress-bodies: gzip .eml bodies (not readable by mu)
+  bool dedup_attachments = false;  // --dedup-attachments: store each distinct attachment once
+  bool dedup_manifest = false;     // --dedup-attachments=manifest: list occurrences instead of hardlinking
+  bool dedup_messages = false;     // --dedup-messages: drop repeated copies of a message (multi-label exports)
+  bool pack_attachments = false;   // --pack: append attachments to per-worker pack files instead of one file each
+  int attachment_shard_levels = 0; // --attachment-shards=N: N levels of two-hex-digit subdirectories
+  bool mail_folders_by_year = false;  // --mail-folders=year: one Maildir++ subfolder per year
+  int mail_folder_size = 0;           // --mail-folders=N: one Maildir++ subfolder per N messages
+  bool label_folders = false;         // --label-folders: hardlink each message into a folder per Gmail label
+  std::unordered_set<std::string> only_labels;  // --labels=a,b: restrict label folders to these labels
+  std::string tar_output;             // --tar=FILE|-: write the output tree as a pax/ustar stream
+  bool resume = false;                // --resume: skip work recorded in the journal of an earlier run
+  bool incremental = false;           // --incremental: skip messages converted by earlier runs
+  bool metadata_index = false;        // --index: write the mbox2eml.index message metadata index
+  bool metadata_jsonl = false;        // --index=jsonl: also write mbox2eml.index.jsonl
+  int threads = 0;                    // --cpu-threads=N: worker threads, 0 for one per core
+  int io_threads = 0;                 // --io-threads=N: threads writing files, 0 to write on the workers
+  bool io_auto = true;                // --io-threads=auto: size the I/O threads from write latency
+  std::string io_backend = "auto";    // --io-backend=auto|uring|posix: how the I/O threads write files
+  Durability durability = kDurabilityBatched;  // --durability=none|batched[,N]|strict
+  int io_batch_messages = 32;         // Messages per I/O batch, and per group sync with --durability=batched
+  bool drop_input_cache = false;      // --drop-input-cache: evict chunk pages from the page cache once read
+  bool drop_output_cache = false;     // --drop-output-cache: write output back early and evict its pages
+  std::string throttle;               // --throttle=read=R,write=W,files=N: I/O limits per second
+  std::string throttle_file;          // --throttle-file=PATH: limits re-read while running
+  bool static_scheduler = false;      // --scheduler=static: split chunks evenly instead of work stealing
+  uint64_t big_message_size = 0;      // --big-messages=SIZE[,THREADS]: own lane for messages this large
+  int big_message_threads = 1;
+};
+
+Options options;
+
+// Function to flush a file or directory to stable storage
+void syncPath(const std::string& path) {
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    throw std::runtime_error("Failed to open " + path + " for syncing: " + strerror(errno));
+  }
+  int result = fsync(fd);
+  int error = errno;
+  close(fd);
+  if (result != 0) {
+    throw std::runtime_error("Failed to sync " + path + ": " + strerror(error));
+  }
+}
+
+// Function to flush a file or directory unless --durability=none
+void syncIfDurable(const std::string& path) {
+  if (options.durability != kDurabilityNone) {
+    syncPath(path);
+  }
+}
+
+// Rate limiter shared by all threads. Callers are charged as they arrive and each waits
+// until the tokens supplied since the start cover everything charged up to and including
+// its own request, so large requests run into debt instead of waiting for a bucket that
+// could never hold them, and waiters are served in arrival order. The bucket holds at
+// most one second's worth of tokens. The rate can change at any time; waiters re-check
+// at least every 100 ms.
+class TokenBucket {
+ public:
+  // Function to set the rate in units per second, or 0 for no limit
+  void setRate(double rate) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    refill();
+    if (rate_ <= 0 && rate > 0) {
+      supplied_ = charged_ + rate;  // Start with a full bucket
+    }
+    rate_ = rate;
+    if (rate > 0) {
+      ever_limited_ = true;
+    }
+    changed_.notify_all();
+  }
+  
+  // Function to take amount tokens, waiting until they are available
+  void acquire(double amount) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (rate_ <= 0) {
+      return;
+    }
+    refill();
+    charged_ += amount;
+    double needed = charged_;
+    if (supplied_ >= needed) {
+      return;
+    }
+    auto start = std::chrono::steady_clock::now();
+    while (rate_ > 0 && supplied_ < needed) {
+      double wait = std::min((needed - supplied_) / rate_, 0.1);
+      changed_.wait_for(lock, std::chrono::duration<double>(wait));
+      refill();
+    }
+    waited_seconds_ += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  }
+  
+  bool everLimited() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return ever_limited_;
+  }
+  
+  double waitedSeconds() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return waited_seconds_;
+  }
+  
+ private:
+  void refill() {
+    auto now = std::chrono::steady_clock::now();
+    double elapsed = std::chrono::duration<double>(now - last_refill_).count();
+    last_refill_ = now;
+    if (rate_ > 0) {
+      supplied_ = std::min(supplied_ + elapsed * rate_, charged_ + rate_);
+    } else {
+      supplied_ = charged_;  // No limit: whoever still waits is released
+    }
+  }
+  
+  std::mutex mutex_;
+  std::condition_variable changed_;
+  double rate_ = 0;
+  double supplied_ = 0;  // Tokens added since the start
+  double charged_ = 0;   // Tokens taken since the start
+  std::chrono::steady_clock::time_point last_refill_ = std::chrono::steady_clock::now();
+  bool ever_limited_ = false;
+  double waited_seconds_ = 0;
+};
+
+// Limits set with --throttle and --throttle-file
+TokenBucket read_limiter;   // Chunk bytes read per second
+TokenBucket write_limiter;  // Output bytes written per second
+TokenBucket file_limiter;   // Output files created per second
+
+// I/O limits per second; 0 means no limit
+struct ThrottleLimits {
+  double read = 0;
+  double write = 0;
+  double files = 0;
+};
+
+// Function to parse limits such as "read=100M,write=50M,files=2000", separated by commas
+// or whitespace, with # starting a comment. Values take K, M and G suffixes; a missing
+// key means no limit.
+ThrottleLimits parseThrottleLimits(const std::string& spec) {
+  ThrottleLimits limits;
+  std::string text;
+  bool comment = false;
+  for (char c : spec) {
+    comment = c == '#' || (comment && c != '\n');
+    text += comment || c == ',' ? ' ' : c;
+  }
+  std::istringstream in(text);
+  std::string item;
+  while (in >> item) {
+    size_t equals = item.find('=');
+    std::string key = item.substr(0, equals);
+    char* end = nullptr;
+    double value = equals == std::string::npos ? -1 : std::strtod(item.c_str() + equals + 1, &end);
+    if (value >= 0) {
+      switch (::tolower(*end)) {
+        case 'k': value *= 1024; end++; break;
+        case 'm': value *= 1024 * 1024; end++; break;
+        case 'g': value *= 1024.0 * 1024 * 1024; end++; break;
+      }
+    }
+    // strtod also accepts "nan" and "inf", which no rate comparison would catch later
+    if (value < 0 || !std::isfinite(value) || *end != '\0' || (key != "read" && key != "write" && key != "files")) {
+      throw std::runtime_error("invalid limit \"" + item + "\", expected read=RATE, write=RATE or files=N");
+    }
+    (key == "read" ? limits.read : key == "write" ? limits.write : limits.files) = value;
+  }
+  return limits;
+}
+
+// Function to put new limits into effect
+void applyThrottleLimits(const ThrottleLimits& limits) {
+  read_limiter.setRate(limits.read);
+  write_limiter.setRate(limits.write);
+  file_limiter.setRate(limits.files);
+  auto describe = [](double value, const char* unit) {
+    std::ostringstream out;
+    if (value > 0) {
+      out << std::fixed << std::setprecision(1) << value << unit;
+    } else {
+      out << "unlimited";
+    }
+    return out.str();
+  };
+  std::cout << "Throttle: read " << describe(limits.read / (1024 * 1024), " MB/s") << ", write "
+            << describe(limits.write / (1024 * 1024), " MB/s") << ", " << describe(limits.files, " files/s")
+            << std::endl;
+}
+
+volatile std::sig_atomic_t throttle_reload_requested = 0;
+
+void requestThrottleReload(int) {
+  throttle_reload_requested = 1;
+}
+
+// Watches the --throttle-file control file and applies its limits (same syntax as
+// --throttle) whenever its modification time changes or SIGHUP arrives, so a long
+// conversion can be slowed down or sped up without restarting it. While the file does
+// not exist, the --throttle limits stay in effect.
+class ThrottleControl {
+ public:
+  explicit ThrottleControl(const std::string& path) : path_(path) {
+    std::signal(SIGHUP, requestThrottleReload);
+    reload(false);
+    watcher_ = std::thread(&ThrottleControl::watch, this);
+  }
+  
+  ~ThrottleControl() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    stopped_.notify_all();
+    watcher_.join();
+  }
+  
+ private:
+  void watch() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stopped_.wait_for(lock, std::chrono::milliseconds(250), [this] { return stop_; })) {
+      bool requested = throttle_reload_requested;
+      throttle_reload_requested = 0;
+      reload(requested);
+    }
+  }
+  
+  void reload(bool requested) {
+    std::error_code error;
+    auto mtime = fs::last_write_time(path_, error);
+    if (error) {
+      // Once the file is deleted, the --throttle limits (or none) apply again
+      if (exists_) {
+        exists_ = false;
+        std::cout << path_ << " was removed, going back to the --throttle limits" << std::endl;
+        applyThrottleLimits(parseThrottleLimits(options.throttle));
+      }
+      return;
+    }
+    if (exists_ && !requested && mtime == mtime_) {
+      return;
+    }
+    exists_ = true;
+    mtime_ = mtime;
+    std::ifstream file(path_);
+    std::ostringstream text;
+    text << file.rdbuf();
+    try {
+      applyThrottleLimits(parseThrottleLimits(text.str()));
+    } catch (const std::exception& e) {
+      std::cerr << "Error in " << path_ << ": " << e.what() << "; keeping the current limits" << std::endl;
+    }
+  }
+  
+  std::string path_;
+  bool exists_ = false;
+  fs::file_time_type mtime_;
+  std::mutex mutex_;
+  std::condition_variable stopped_;
+  bool stop_ = false;
+  std::thread watcher_;
 };
 
-// Function to parse RFC 2822 date format to timestamp
+// Name of the shared compression dictionary stored under the output root
+const char* const kDictionaryFilename = "mbox2eml.dict";
+// Files up to this size are compressed with the shared dictionary in --dict mode
+const size_t kDictMaxFileSize = 128 * 1024;
+// zlib can only reference the last 32 KB of a preset dictionary
+const size_t kDictMaxSize = 32 * 1024;
+// Amount of stripped email content sampled to train the dictionary
+const size_t kDictSampleSize = 8 * 1024 * 1024;
+
+// The trained or loaded dictionary, read-only once workers start
+std::string compression_dictionary;
+std::atomic<long> dictionary_compressed_files{0};
+
+// Function to read a numeric "+hhmm" or "-hhmm" zone as seconds east of UTC; false if the
+// token is not one
+bool parseZoneOffset(const std::string& token, long& offset) {
+  if (token.size() != 5 || (token[0] != '+' && token[0] != '-') ||
+      !std::all_of(token.begin() + 1, token.end(), ::isdigit)) {
+    return false;
+  }
+  int hhmm = std::stoi(token.substr(1));
+  offset = (hhmm / 100 * 3600 + hhmm % 100 * 60) * (token[0] == '-' ? -1 : 1);
+  return true;
+}
+
+// Function to parse RFC 2822 date format to timestamp. The numeric zone is applied by
+// hand and the rest converted with timegm, so the result never depends on the host's
+// time zone; dates without a numeric zone ("GMT", "EST", none) are taken as UTC.
 std::time_t parseEmailDate(const std::string& date_str) {
-  // Common email date formats to try
-  std::vector<std::string> formats = {
-    "%a, %d %b %Y %H:%M:%S %z",     // RFC 2822: "Mon, 01 Jan 2024 12:00:00 +0000"
-    "%d %b %Y %H:%M:%S %z",        // "01 Jan 2024 12:00:00 +0000"
-    "%a, %d %b %Y %H:%M:%S",       // Without timezone
-    "%d %b %Y %H:%M:%S"
+  // Common email date formats to try, each followed by an optional zone
+  const char* const formats[] = {
+    "%a, %d %b %Y %H:%M:%S",  // RFC 2822: "Mon, 01 Jan 2024 12:00:00 +0000"
+    "%d %b %Y %H:%M:%S",      // "01 Jan 2024 12:00:00 +0000"
   };
   
-  std::tm tm = {};
-  for (const auto& format : formats) {
+  for (const char* format : formats) {
+    std::tm tm = {};
     std::istringstream ss(date_str);
-    ss >> std::get_time(&tm, format.c_str());
-    if (!ss.fail()) {
-      return std::mktime(&tm);
+    ss >> std::get_time(&tm, format);
+    if (ss.fail()) {
+      continue;
     }
+    std::string zone;
+    long offset = 0;
+    if (ss >> zone) {
+      parseZoneOffset(zone, offset);
+    }
+    return timegm(&tm) - offset;
   }
   
-  // If parsing fails, return current time as fallback
-  auto now = std::chrono::system_clock::now();
-  return std::chrono::system_clock::to_time_t(now);
+  // If parsing fails, return -1 like mktime
+  return -1;
 }
 
 // Function to decode base64 content properly
@@ -277,8 +642,364 @@ std::vector<std::string> extractBoundaries(const std::string& content) {
   return boundaries;
 }
 
+// Only this much of an attachment is sampled for the entropy estimate
+const size_t kEntropySampleSize = 64 * 1024;
+// Samples smaller than this are too short for a meaningful estimate
+const size_t kEntropyMinSampleSize = 512;
+// Above this many bits per byte deflate gains next to nothing
+const double kIncompressibleEntropy = 7.5;
+
+// Compile-time table of formats that are already compressed, keyed by lowercase
+// file extension (without the dot) or by lowercase MIME type
+struct CompressedFormat {
+  std::string_view key;
+  CompressionRule rule;
+};
+
+constexpr CompressedFormat kCompressedFormats[] = {
+  // Image formats
+  {"jpg", kRuleExtension}, {"jpeg", kRuleExtension}, {"png", kRuleExtension},
+  {"gif", kRuleExtension}, {"webp", kRuleExtension}, {"bmp", kRuleExtension},
+  {"heic", kRuleExtension}, {"heif", kRuleExtension},
+  // Archive formats
+  {"zip", kRuleExtension}, {"rar", kRuleExtension}, {"7z", kRuleExtension},
+  {"gz", kRuleExtension}, {"tgz", kRuleExtension}, {"bz2", kRuleExtension},
+  {"xz", kRuleExtension}, {"zst", kRuleExtension},
+  // Office formats that are ZIP containers
+  {"docx", kRuleExtension}, {"xlsx", kRuleExtension}, {"pptx", kRuleExtension},
+  {"odt", kRuleExtension}, {"ods", kRuleExtension}, {"odp", kRuleExtension},
+  // Video/Audio formats
+  {"mp4", kRuleExtension}, {"mov", kRuleExtension}, {"avi", kRuleExtension},
+  {"mkv", kRuleExtension}, {"webm", kRuleExtension}, {"mp3", kRuleExtension},
+  {"m4a", kRuleExtension}, {"aac", kRuleExtension}, {"flac", kRuleExtension},
+  {"ogg", kRuleExtension},
+  // MIME types
+  {"image/jpeg", kRuleContentType}, {"image/png", kRuleContentType},
+  {"image/gif", kRuleContentType}, {"image/webp", kRuleContentType},
+  {"image/heic", kRuleContentType}, {"image/heif", kRuleContentType},
+  {"application/zip", kRuleContentType}, {"application/x-zip", kRuleContentType},
+  {"application/x-zip-compressed", kRuleContentType}, {"application/gzip", kRuleContentType},
+  {"application/x-gzip", kRuleContentType}, {"application/x-7z-compressed", kRuleContentType},
+  {"application/vnd.rar", kRuleContentType}, {"application/x-rar-compressed", kRuleContentType},
+  {"application/x-bzip2", kRuleContentType}, {"application/x-xz", kRuleContentType},
+  {"application/zstd", kRuleContentType},
+  {"application/vnd.openxmlformats-officedocument.wordprocessingml.document", kRuleContentType},
+  {"application/vnd.openxmlformats-officedocument.spreadsheetml.sheet", kRuleContentType},
+  {"application/vnd.openxmlformats-officedocument.presentationml.presentation", kRuleContentType},
+  {"video/mp4", kRuleContentType}, {"video/quicktime", kRuleContentType},
+  {"video/x-matroska", kRuleContentType}, {"video/webm", kRuleContentType},
+  {"audio/mpeg", kRuleContentType}, {"audio/mp4", kRuleContentType},
+  {"audio/aac", kRuleContentType}, {"audio/ogg", kRuleContentType},
+  {"audio/flac", kRuleContentType},
+};
+
+constexpr size_t kNumCompressedFormats = sizeof(kCompressedFormats) / sizeof(kCompressedFormats[0]);
+constexpr size_t kFormatTableSize = 256; // power of two
+constexpr size_t kMaxFormatKeyLength = 80;
+constexpr uint32_t kNoFormatSeed = UINT32_MAX;
+
+// Seeded FNV-1a hash used to place format keys in the lookup table
+constexpr uint32_t hashFormatKey(std::string_view key, uint32_t seed) {
+  uint32_t hash = 2166136261u ^ seed;
+  for (char c : key) {
+    hash ^= static_cast<unsigned char>(c);
+    hash *= 16777619u;
+  }
+  return hash ^ (hash >> 15);
+}
+
+// Function to search, at compile time, for a seed that maps every key to its own slot
+constexpr uint32_t findFormatSeed() {
+  for (uint32_t seed = 0; seed < 10000; ++seed) {
+    std::array<bool, kFormatTableSize> used{};
+    bool collision = false;
+    for (const auto& format : kCompressedFormats) {
+      size_t slot = hashFormatKey(format.key, seed) & (kFormatTableSize - 1);
+      if (used[slot]) {
+        collision = true;
+        break;
+      }
+      used[slot] = true;
+    }
+    if (!collision) {
+      return seed;
+    }
+  }
+  return kNoFormatSeed;
+}
+
+constexpr uint32_t kFormatSeed = findFormatSeed();
+static_assert(kFormatSeed != kNoFormatSeed, "No perfect hash seed found for kCompressedFormats");
+
+// Slot -> index into kCompressedFormats, or -1 for an empty slot
+constexpr std::array<int16_t, kFormatTableSize> buildFormatTable() {
+  std::array<int16_t, kFormatTableSize> table{};
+  table.fill(-1);
+  for (size_t i = 0; i < kNumCompressedFormats; ++i) {
+    table[hashFormatKey(kCompressedFormats[i].key, kFormatSeed) & (kFormatTableSize - 1)] = i;
+  }
+  return table;
+}
+
+constexpr std::array<int16_t, kFormatTableSize> kFormatTable = buildFormatTable();
+
+// Function to look up a key (lowercased into a stack buffer) in the compressed format table
+const CompressedFormat* findCompressedFormat(std::string_view key) {
+  if (key.empty() || key.size() > kMaxFormatKeyLength) {
+    return nullptr;
+  }
+  char lower[kMaxFormatKeyLength];
+  for (size_t i = 0; i < key.size(); ++i) {
+    lower[i] = static_cast<char>(::tolower(static_cast<unsigned char>(key[i])));
+  }
+  std::string_view lower_key(lower, key.size());
+  
+  int16_t index = kFormatTable[hashFormatKey(lower_key, kFormatSeed) & (kFormatTableSize - 1)];
+  if (index < 0 || kCompressedFormats[index].key != lower_key) {
+    return nullptr;
+  }
+  return &kCompressedFormats[index];
+}
+
+// Function to get the extension of a filename without the dot
+std::string_view fileExtension(std::string_view filename) {
+  size_t dot = filename.rfind('.');
+  if (dot == std::string_view::npos) {
+    return {};
+  }
+  return filename.substr(dot + 1);
+}
+
+// Function to get the bare MIME type out of a "Content-Type: type/subtype; params" header line
+std::string_view mimeType(std::string_view content_type) {
+  size_t colon = content_type.find(':');
+  if (colon != std::string_view::npos) {
+    content_type.remove_prefix(colon + 1);
+  }
+  size_t start = content_type.find_first_not_of(" \t");
+  if (start == std::string_view::npos) {
+    return {};
+  }
+  content_type.remove_prefix(start);
+  return content_type.substr(0, content_type.find_first_of("; \t\r\n"));
+}
+
+// Function to detect compressed container formats from their leading bytes
+bool hasCompressedMagic(const std::string& content) {
+  auto starts_with = [&](size_t offset, std::string_view magic) {
+    return content.size() >= offset + magic.size() &&
+           std::string_view(content).substr(offset, magic.size()) == magic;
+  };
+  
+  return starts_with(0, "\xFF\xD8\xFF") ||                    // JPEG
+         starts_with(0, "\x89PNG\r\n\x1A\n") ||               // PNG
+         starts_with(0, "GIF8") ||                            // GIF
+         (starts_with(0, "RIFF") && starts_with(8, "WEBP")) || // WebP
+         starts_with(0, "PK\x03\x04") ||                      // ZIP, docx/xlsx/pptx, odt, jar
+         starts_with(0, "\x1F\x8B") ||                        // gzip
+         starts_with(0, "BZh") ||                             // bzip2
+         starts_with(0, "\xFD" "7zXZ") ||                     // xz
+         starts_with(0, "7z\xBC\xAF\x27\x1C") ||              // 7-Zip
+         starts_with(0, "Rar!\x1A\x07") ||                    // RAR
+         starts_with(0, "\x28\xB5\x2F\xFD") ||                // zstd
+         starts_with(4, "ftyp") ||                            // MP4, MOV, HEIC, M4A
+         starts_with(0, "\x1A\x45\xDF\xA3") ||                // Matroska, WebM
+         starts_with(0, "ID3") ||                             // MP3 with ID3 tag
+         starts_with(0, "fLaC") ||                            // FLAC
+         starts_with(0, "OggS");                              // Ogg
+}
+
+// Function to estimate the Shannon entropy (bits per byte) of the start of the content
+double estimateEntropy(const std::string& content) {
+  size_t sample_size = std::min(content.size(), kEntropySampleSize);
+  std::array<size_t, 256> histogram{};
+  for (size_t i = 0; i < sample_size; ++i) {
+    histogram[static_cast<unsigned char>(content[i])]++;
+  }
+  
+  double entropy = 0.0;
+  for (size_t count : histogram) {
+    if (count > 0) {
+      double p = static_cast<double>(count) / sample_size;
+      entropy -= p * std::log2(p);
+    }
+  }
+  return entropy;
+}
+
+// Function to decide, once per attachment, whether it is worth compressing
+CompressionRule classifyCompression(const std::string& filename, const std::string& content_type,
+                                    const std::string& content) {
+  if (const CompressedFormat* format = findCompressedFormat(fileExtension(filename))) {
+    return format->rule;
+  }
+  if (const CompressedFormat* format = findCompressedFormat(mimeType(content_type))) {
+    return format->rule;
+  }
+  if (hasCompressedMagic(content)) {
+    return kRuleMagicBytes;
+  }
+  if (content.size() >= kEntropyMinSampleSize && estimateEntropy(content) > kIncompressibleEntropy) {
+    return kRuleEntropy;
+  }
+  return kRuleCompress;
+}
+
+// XXH64 (https://github.com/Cyan4973/xxHash), used to content-address attachments
+const uint64_t kXXH64Prime1 = 0x9E3779B185EBCA87ULL;
+const uint64_t kXXH64Prime2 = 0xC2B2AE3D27D4EB4FULL;
+const uint64_t kXXH64Prime3 = 0x165667B19E3779F9ULL;
+const uint64_t kXXH64Prime4 = 0x85EBCA77C2B2AE63ULL;
+const uint64_t kXXH64Prime5 = 0x27D4EB2F165667C5ULL;
+
+inline uint64_t rotl64(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+inline uint64_t read64(const char* p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+inline uint32_t read32(const char* p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+inline uint64_t xxh64Round(uint64_t acc, uint64_t input) {
+  acc += input * kXXH64Prime2;
+  acc = rotl64(acc, 31);
+  return acc * kXXH64Prime1;
+}
+
+inline uint64_t xxh64Merge(uint64_t acc, uint64_t val) {
+  acc ^= xxh64Round(0, val);
+  return acc * kXXH64Prime1 + kXXH64Prime4;
+}
+
+// Function to compute the XXH64 digest of data (little-endian hosts)
+uint64_t xxh64(std::string_view data, uint64_t seed) {
+  const char* p = data.data();
+  const char* end = p + data.size();
+  uint64_t hash;
+  
+  if (data.size() >= 32) {
+    uint64_t v1 = seed + kXXH64Prime1 + kXXH64Prime2;
+    uint64_t v2 = seed + kXXH64Prime2;
+    uint64_t v3 = seed;
+    uint64_t v4 = seed - kXXH64Prime1;
+    do {
+      v1 = xxh64Round(v1, read64(p));
+      v2 = xxh64Round(v2, read64(p + 8));
+      v3 = xxh64Round(v3, read64(p + 16));
+      v4 = xxh64Round(v4, read64(p + 24));
+      p += 32;
+    } while (p + 32 <= end);
+    hash = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+    hash = xxh64Merge(hash, v1);
+    hash = xxh64Merge(hash, v2);
+    hash = xxh64Merge(hash, v3);
+    hash = xxh64Merge(hash, v4);
+  } else {
+    hash = seed + kXXH64Prime5;
+  }
+  
+  hash += data.size();
+  for (; p + 8 <= end; p += 8) {
+    hash ^= xxh64Round(0, read64(p));
+    hash = rotl64(hash, 27) * kXXH64Prime1 + kXXH64Prime4;
+  }
+  if (p + 4 <= end) {
+    hash ^= static_cast<uint64_t>(read32(p)) * kXXH64Prime1;
+    hash = rotl64(hash, 23) * kXXH64Prime2 + kXXH64Prime3;
+    p += 4;
+  }
+  for (; p < end; ++p) {
+    hash ^= static_cast<unsigned char>(*p) * kXXH64Prime5;
+    hash = rotl64(hash, 11) * kXXH64Prime1;
+  }
+  
+  hash ^= hash >> 33;
+  hash *= kXXH64Prime2;
+  hash ^= hash >> 29;
+  hash *= kXXH64Prime3;
+  hash ^= hash >> 32;
+  return hash;
+}
+
+// Function to compute a 128-bit content address (two independently seeded XXH64 digests) as hex.
+// Computed when deduplicating, packing or sharding attachments.
+std::string hashContent(std::string_view data) {
+  char hex[33];
+  snprintf(hex, sizeof(hex), "%016llx%016llx",
+           static_cast<unsigned long long>(xxh64(data, 0)),
+           static_cast<unsigned long long>(xxh64(data, kXXH64Prime5)));
+  return hex;
+}
+
+// Function to write a number into a buffer with std::to_chars, zero-padded to width;
+// returns the end of the text. The buffer must hold 20 characters or width.
+template <typename Number>
+char* formatNumber(char* out, Number value, int width = 0) {
+  char digits[24];
+  char* digits_end = std::to_chars(digits, digits + sizeof(digits), value).ptr;
+  if (digits_end - digits < width) {
+    out = std::fill_n(out, width - (digits_end - digits), '0');
+  }
+  return std::copy(digits, digits_end, out);
+}
+
+// Function to copy text into a buffer; returns the end of the copy
+char* appendText(char* out, std::string_view text) {
+  return std::copy(text.begin(), text.end(), out);
+}
+
+// Function to get the suffix a saved attachment gets for its storage encoding
+std::string attachmentSuffix(const Attachment& attachment) {
+  if (attachment.compression_rule != kRuleCompress) {
+    return "";
+  }
+  if (options.use_dictionary && attachment.content.size() <= kDictMaxFileSize) {
+    return ".zd";
+  }
+  return ".gz";
+}
+
+// Function to get the shard subdirectories of an attachment ("3f/a2/" for two levels),
+// taken from its content hash so they are known as soon as the attachment is decoded
+std::string attachmentShard(const Attachment& attachment, int levels) {
+  std::string shard;
+  for (int level = 0; level < levels; ++level) {
+    shard += attachment.content_hash.substr(level * 2, 2) + "/";
+  }
+  return shard;
+}
+
+// Function to get the path of a deduplicated attachment blob relative to attachments/.
+// The suffix is part of the key so the same bytes stored two ways never collide.
+std::string blobName(const Attachment& attachment) {
+  return "objects/" + attachmentShard(attachment, std::max(1, options.attachment_shard_levels)) +
+         attachment.content_hash + attachmentSuffix(attachment);
+}
+
+// Function to get the file name of an attachment, without shard directories and suffix:
+// email_NNNNNNNNN_attachment_N_filename
+std::string attachmentFilename(int email_count, size_t index, const Attachment& attachment) {
+  char prefix[64];
+  char* end = appendText(prefix, "email_");
+  end = formatNumber(end, email_count, 9);
+  end = appendText(end, "_attachment_");
+  end = formatNumber(end, index);
+  end = appendText(end, "_");
+  std::string name;
+  name.reserve((end - prefix) + attachment.filename.size());
+  return name.append(prefix, end).append(attachment.filename);
+}
+
 // Function to extract attachments from MIME email content (Gmail Takeout compatible)
-Email extractAttachments(const std::string& content) {
+Email extractAttachments(const std::string& content, int email_count) {
   Email email;
   
   // Extract all boundaries
@@ -447,23 +1168,27 @@ Email extractAttachments(const std::string& content) {
         } else {
           attachment.content = body;
         }
+        attachment.compression_rule = classifyCompression(attachment.filename, attachment.content_type,
+                                                          attachment.content);
+        if (options.dedup_attachments || options.pack_attachments || options.attachment_shard_levels > 0 ||
+            options.metadata_index) {
+          attachment.content_hash = hashContent(attachment.content);
+        }
         
         email.attachments.push_back(attachment);
         
         // Generate the actual saved filename for reference
-        std::ostringstream saved_filename;
-        saved_filename << "email_" << std::setfill('0') << std::setw(9) << 0  // placeholder for email_count
-                       << "_attachment_" << (email.attachments.size() - 1) << "_" << attachment.filename;
+        std::string saved_filename = attachmentFilename(email_count, email.attachments.size() - 1, attachment);
         
-        // Determine compression based on file type (simple check here)
-        std::string lower_filename = attachment.filename;
-        std::transform(lower_filename.begin(), lower_filename.end(), lower_filename.begin(), ::tolower);
-        bool will_compress = !(lower_filename.ends_with(".jpg") || lower_filename.ends_with(".jpeg") ||
-                              lower_filename.ends_with(".png") || lower_filename.ends_with(".gif") ||
-                              lower_filename.ends_with(".zip") || lower_filename.ends_with(".gz") ||
-                              attachment.content_type.find("image/") != std::string::npos);
-        
-        std::string full_saved_name = saved_filename.str() + (will_compress ? ".gz" : "");
+        std::string full_saved_name;
+        if (options.pack_attachments) {
+          full_saved_name = "pack:" + saved_filename + attachmentSuffix(attachment);
+        } else if (options.dedup_attachments) {
+          full_saved_name = blobName(attachment);
+        } else {
+          full_saved_name = attachmentShard(attachment, options.attachment_shard_levels) +
+                            saved_filename + attachmentSuffix(attachment);
+        }
         
         // Add marker with both original and saved filenames
         attachment_markers.push_back("[Attachment extracted: " + attachment.filename + 
@@ -507,18 +1232,49 @@ Email extractAttachments(const std::string& content) {
   return email;
 }
 
+// Function to parse the date of an mbox "From " line, -1 if it has none. Takeout writes
+// "From 123@xxx Mon Jan 01 12:00:00 +0000 2024"; classic mbox leaves out the zone, which
+// is then taken as UTC, so the result never depends on the converting host's time zone.
+std::time_t parseFromLineDate(const std::string& line) {
+  std::istringstream fields(line.substr(5));
+  std::string sender;
+  std::string token;
+  std::tm tm = {};
+  fields >> sender >> std::get_time(&tm, "%a %b %d %H:%M:%S") >> token;
+  if (fields.fail()) {
+    return -1;
+  }
+  long offset = 0;
+  if (parseZoneOffset(token, offset) && !(fields >> token)) {
+    return -1;
+  }
+  int year = 0;
+  auto [end, error] = std::from_chars(token.data(), token.data() + token.size(), year);
+  if (error != std::errc() || end != token.data() + token.size()) {
+    return -1;
+  }
+  tm.tm_year = year - 1900;
+  return timegm(&tm) - offset;
+}
+
 // Function to extract Date header from email content
 std::time_t extractEmailTimestamp(const std::string& content) {
   std::istringstream stream(content);
   std::string line;
+  std::time_t from_line_time = -1;
   
-  // Skip the "From " line and look for Date header
+  // Look for the Date header, remembering the date of the "From " line
   while (std::getline(stream, line)) {
-    if (line.empty()) {
+    if (line.empty() || line == "\r") {
       // End of headers, no Date found
       break;
     }
     
+    if (line.starts_with("From ")) {
+      from_line_time = parseFromLineDate(line);
+      continue;
+    }
+    
     // Check for Date header (case-insensitive)
     if (line.length() > 5 && 
         (line.substr(0, 5) == "Date:" || line.substr(0, 5) == "date:")) {
@@ -526,308 +1282,3732 @@ std::time_t extractEmailTimestamp(const std::string& content) {
       // Remove leading/trailing whitespace
       date_part.erase(0, date_part.find_first_not_of(" \t"));
       date_part.erase(date_part.find_last_not_of(" \t\r\n") + 1);
-      return parseEmailDate(date_part);
+      std::time_t timestamp = parseEmailDate(date_part);
+      if (timestamp != -1) {
+        return timestamp;
+      }
+      break;
     }
   }
   
-  // Fallback to current time if no Date header found
-  auto now = std::chrono::system_clock::now();
-  return std::chrono::system_clock::to_time_t(now);
-}
-
-// Function to extract individual emails from the mbox file
-std::vector<Email> extractEmails(const std::string& mbox_file) {
-  std::vector<Email> emails;
-  std::ifstream file(mbox_file);
-  std::string line;
-  Email current_email;
-
-  while (std::getline(file, line)) {
-    if (line.starts_with("From ")) { // use c++20 feature
-      // Start of a new email
-      if (!current_email.content.empty()) {
-        current_email.timestamp = extractEmailTimestamp(current_email.content);
-        Email processed_email = extractAttachments(current_email.content);
-        processed_email.timestamp = current_email.timestamp;  // Preserve timestamp
-        emails.push_back(processed_email);
-      }
-      current_email = Email{}; // Reset
-      current_email.content = line + "\n";
-    } else {
-      current_email.content += line + "\n";
-    }
-  }
-
-  // Add the last email
-  if (!current_email.content.empty()) {
-    current_email.timestamp = extractEmailTimestamp(current_email.content);
-    Email processed_email = extractAttachments(current_email.content);
-    processed_email.timestamp = current_email.timestamp;  // Preserve timestamp
-    emails.push_back(processed_email);
-  }
-
-  return emails;
+  // Fall back to the "From " line date, then to the epoch, so that file names do not
+  // depend on when the conversion runs
+  return from_line_time != -1 ? from_line_time : 0;
 }
 
-// Function to create Maildir structure with attachments directory
-void createMaildirStructure(const std::string& output_dir) {
-  try {
-    // Create main output directory if it doesn't exist
-    fs::create_directories(output_dir);
-    
-    // Create Maildir subdirectories
-    fs::create_directory(output_dir + "/cur");
-    fs::create_directory(output_dir + "/new");
-    fs::create_directory(output_dir + "/tmp");
-    
-    // Create attachments directory
-    fs::create_directory(output_dir + "/attachments");
+// Concurrent set of 64-bit fingerprints, compact enough for tens of millions of
+// messages: lock-striped open-addressing tables holding only the fingerprints
+class FingerprintSet {
+ public:
+  // Returns true if the fingerprint was not in the set yet
+  bool insert(uint64_t fingerprint) {
+    if (fingerprint == 0) fingerprint = 1; // 0 marks an empty slot
+    Shard& shard = shards_[fingerprint % kNumShards];
+    std::lock_guard<std::mutex> lock(shard.mutex);
     
-    std::cout << "Created Maildir structure with attachments directory in " << output_dir << std::endl;
-  } catch (const std::exception& e) {
-    std::cerr << "Error creating Maildir structure: " << e.what() << std::endl;
-    throw;
+    if ((shard.count + 1) * 4 > shard.slots.size() * 3) {
+      grow(shard);
+    }
+    if (!insertSlot(shard.slots, fingerprint)) {
+      return false;
+    }
+    shard.count++;
+    return true;
   }
-}
-
-// Function to find and sort chunk files
-std::vector<std::string> findChunkFiles(const std::string& input_dir) {
-  std::vector<std::pair<int, std::string>> chunk_files;
-  std::regex chunk_pattern(R"(chunk_(\d+)\.mbox)");
   
-  try {
-    for (const auto& entry : fs::directory_iterator(input_dir)) {
-      if (entry.is_regular_file()) {
-        std::string filename = entry.path().filename().string();
-        std::smatch match;
-        
-        if (std::regex_match(filename, match, chunk_pattern)) {
-          int chunk_number = std::stoi(match[1].str());
-          chunk_files.emplace_back(chunk_number, entry.path().string());
-        }
+  // Function to collect every fingerprint in the set
+  std::vector<uint64_t> values() {
+    std::vector<uint64_t> result;
+    for (Shard& shard : shards_) {
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      for (uint64_t fingerprint : shard.slots) {
+        if (fingerprint != 0) result.push_back(fingerprint);
       }
     }
-  } catch (const std::exception& e) {
-    std::cerr << "Error reading directory: " << e.what() << std::endl;
+    return result;
   }
   
-  // Sort by chunk number
-  std::sort(chunk_files.begin(), chunk_files.end());
+ private:
+  static const size_t kNumShards = 64;
+  static const size_t kInitialSlots = 1024; // per shard, power of two
   
-  // Extract just the file paths
-  std::vector<std::string> sorted_files;
-  for (const auto& pair : chunk_files) {
-    sorted_files.push_back(pair.second);
+  struct Shard {
+    std::mutex mutex;
+    std::vector<uint64_t> slots;
+    size_t count = 0;
+  };
+  
+  static bool insertSlot(std::vector<uint64_t>& slots, uint64_t fingerprint) {
+    size_t mask = slots.size() - 1;
+    // The low bits chose the shard, so probe with the high bits
+    for (size_t i = (fingerprint >> 8) & mask; ; i = (i + 1) & mask) {
+      if (slots[i] == fingerprint) return false;
+      if (slots[i] == 0) {
+        slots[i] = fingerprint;
+        return true;
+      }
+    }
   }
   
-  return sorted_files;
-}
-
-// Function to compress data using gzip
-std::string compressGzip(const std::string& data) {
-  z_stream zs;
-  memset(&zs, 0, sizeof(zs));
+  static void grow(Shard& shard) {
+    std::vector<uint64_t> slots(std::max(kInitialSlots, shard.slots.size() * 2), 0);
+    for (uint64_t fingerprint : shard.slots) {
+      if (fingerprint != 0) insertSlot(slots, fingerprint);
+    }
+    shard.slots.swap(slots);
+  }
   
-  // Use faster compression level for better throughput in multi-threaded scenario
+  std::array<Shard, kNumShards> shards_;
+};
+
+FingerprintSet seen_messages;
+// Messages saved by this run (or by the run it resumes), persisted by --incremental
+FingerprintSet delivered_messages;
+std::atomic<long> duplicate_messages_dropped{0};
+
+const std::string kSeenFilename = "mbox2eml.seen";
+const char kSeenMagic[8] = {'M', 'B', 'X', 'S', 'E', 'E', 'N', '1'};
+const uint64_t kSeenBloomBitsPerEntry = 10;
+const int kSeenBloomProbes = 7;
+
+// Header of mbox2eml.seen; it is followed by bloom_words 64-bit Bloom filter words and
+// then by count sorted 64-bit message fingerprints
+struct SeenFileHeader {
+  char magic[8];
+  uint64_t next_email_number;
+  uint64_t count;
+  uint64_t bloom_words;
+};
+
+// The messages converted by earlier --incremental runs into the same output directory.
+// The file is mapped read-only: the Bloom filter answers most lookups for new messages,
+// and a binary search of the sorted table confirms the hits.
+class ConvertedMessages {
+ public:
+  ~ConvertedMessages() {
+    if (mapping_ != nullptr) {
+      munmap(mapping_, mapping_size_);
+    }
+  }
+  
+  // Function to map the seen file; a missing file means no earlier runs
+  void load(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      if (errno == ENOENT) return;
+      throw std::runtime_error("Failed to open " + path + ": " + strerror(errno));
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(SeenFileHeader)) {
+      close(fd);
+      throw std::runtime_error("Truncated seen file: " + path);
+    }
+    mapping_size_ = st.st_size;
+    mapping_ = mmap(nullptr, mapping_size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping_ == MAP_FAILED) {
+      mapping_ = nullptr;
+      throw std::runtime_error("Failed to map " + path + ": " + strerror(errno));
+    }
+    
+    const SeenFileHeader* header = static_cast<const SeenFileHeader*>(mapping_);
+    if (memcmp(header->magic, kSeenMagic, sizeof(kSeenMagic)) != 0 ||
+        mapping_size_ != sizeof(SeenFileHeader) + (header->bloom_words + header->count) * sizeof(uint64_t)) {
+      throw std::runtime_error("Not a valid seen file: " + path);
+    }
+    next_email_number_ = header->next_email_number;
+    bloom_ = reinterpret_cast<const uint64_t*>(header + 1);
+    bloom_words_ = header->bloom_words;
+    table_ = bloom_ + bloom_words_;
+    count_ = header->count;
+  }
+  
+  bool contains(uint64_t fingerprint) const {
+    if (count_ == 0 || !bloomContains(bloom_, bloom_words_, fingerprint)) {
+      return false;
+    }
+    return std::binary_search(table_, table_ + count_, fingerprint);
+  }
+  
+  size_t size() const { return count_; }
+  uint64_t nextEmailNumber() const { return next_email_number_; }
+  
+  // Function to write a new seen file from this one plus the given fingerprints
+  void save(const std::string& path, std::vector<uint64_t> added, uint64_t next_email_number) const {
+    added.insert(added.end(), table_, table_ + count_);
+    std::sort(added.begin(), added.end());
+    added.erase(std::unique(added.begin(), added.end()), added.end());
+    
+    SeenFileHeader header;
+    memcpy(header.magic, kSeenMagic, sizeof(kSeenMagic));
+    header.next_email_number = next_email_number;
+    header.count = added.size();
+    header.bloom_words = std::max<uint64_t>(1, (added.size() * kSeenBloomBitsPerEntry + 63) / 64);
+    std::vector<uint64_t> bloom(header.bloom_words, 0);
+    for (uint64_t fingerprint : added) {
+      forEachBloomBit(header.bloom_words, fingerprint, [&](uint64_t bit) {
+        bloom[bit / 64] |= uint64_t(1) << (bit % 64);
+      });
+    }
+    
+    std::ofstream file(path + ".tmp", std::ios::binary | std::ios::trunc);
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(bloom.data()), bloom.size() * sizeof(uint64_t));
+    file.write(reinterpret_cast<const char*>(added.data()), added.size() * sizeof(uint64_t));
+    file.close();
+    if (!file) {
+      throw std::runtime_error("Failed to write " + path + ".tmp");
+    }
+    syncIfDurable(path + ".tmp");
+    fs::rename(path + ".tmp", path);
+  }
+  
+ private:
+  // Probe positions come from the two halves of the fingerprint (double hashing)
+  template <typename Visit>
+  static void forEachBloomBit(uint64_t words, uint64_t fingerprint, Visit visit) {
+    uint64_t bits = words * 64;
+    uint64_t h1 = fingerprint & 0xffffffff;
+    uint64_t h2 = (fingerprint >> 32) | 1;
+    for (int i = 0; i < kSeenBloomProbes; ++i) {
+      visit((h1 + i * h2) % bits);
+    }
+  }
+  
+  static bool bloomContains(const uint64_t* bloom, uint64_t words, uint64_t fingerprint) {
+    bool found = true;
+    forEachBloomBit(words, fingerprint, [&](uint64_t bit) {
+      found = found && (bloom[bit / 64] >> (bit % 64)) & 1;
+    });
+    return found;
+  }
+  
+  void* mapping_ = nullptr;
+  size_t mapping_size_ = 0;
+  const uint64_t* bloom_ = nullptr;
+  uint64_t bloom_words_ = 0;
+  const uint64_t* table_ = nullptr;
+  uint64_t count_ = 0;
+  uint64_t next_email_number_ = 0;
+};
+
+ConvertedMessages converted_messages;
+std::atomic<long> already_converted_dropped{0};
+
+// Function to get the unfolded value of a top-level header ("" if it is missing).
+// Continuation lines (starting with whitespace) are joined onto the first line.
+std::string extractHeader(const std::string& content, std::string_view name) {
+  size_t line_start = 0;
+  while (line_start < content.size()) {
+    size_t line_end = content.find('\n', line_start);
+    if (line_end == std::string::npos) line_end = content.size();
+    if (line_end == line_start || (line_end == line_start + 1 && content[line_start] == '\r')) {
+      break; // End of headers
+    }
+    
+    if (line_end - line_start > name.size() && content[line_start + name.size()] == ':' &&
+        strncasecmp(content.c_str() + line_start, name.data(), name.size()) == 0) {
+      std::string value;
+      size_t pos = line_start + name.size() + 1;
+      while (true) {
+        value.append(content, pos, line_end - pos);
+        if (!value.empty() && value.back() == '\r') value.pop_back();
+        // Folded header: continuation lines start with whitespace
+        if (line_end + 1 < content.size() && (content[line_end + 1] == ' ' || content[line_end + 1] == '\t')) {
+          pos = line_end + 1;
+          line_end = content.find('\n', pos);
+          if (line_end == std::string::npos) line_end = content.size();
+        } else {
+          break;
+        }
+      }
+      value.erase(0, value.find_first_not_of(" \t"));
+      return value;
+    }
+    line_start = line_end + 1;
+  }
+  return "";
+}
+
+// Function to get the normalized Message-ID of a raw message ("" if it has none).
+// Angle brackets and whitespace are dropped and case is ignored.
+std::string extractMessageId(const std::string& content) {
+  std::string message_id;
+  for (char c : extractHeader(content, "Message-ID")) {
+    if (c != '<' && c != '>' && c != ' ' && c != '\t') {
+      message_id += static_cast<char>(::tolower(static_cast<unsigned char>(c)));
+    }
+  }
+  return message_id;
+}
+
+// Function to split the X-Gmail-Labels header into labels. Labels are comma separated;
+// labels containing commas are double-quoted.
+std::vector<std::string> extractGmailLabels(const std::string& content) {
+  std::vector<std::string> labels;
+  std::string header = extractHeader(content, "X-Gmail-Labels");
+  std::string label;
+  bool quoted = false;
+  
+  for (size_t i = 0; i <= header.size(); ++i) {
+    char c = i < header.size() ? header[i] : ',';
+    if (c == '"') {
+      quoted = !quoted;
+    } else if (c == ',' && !quoted) {
+      label.erase(0, label.find_first_not_of(" \t"));
+      label.erase(label.find_last_not_of(" \t") + 1);
+      if (!label.empty()) {
+        labels.push_back(label);
+      }
+      label.clear();
+    } else {
+      label += c;
+    }
+  }
+  return labels;
+}
+
+// Function to map a Gmail label to a Maildir++ folder name: "/" nests folders, while
+// characters Maildir++ or the filesystem treat specially are replaced. A name made up of
+// dots only ("." for an empty label, ".." for "/") would point at the output directory or
+// its parent, so its dots are replaced as well.
+std::string labelFolder(const std::string& label) {
+  std::string folder = ".";
+  for (char c : label) {
+    if (c == '/') {
+      folder += '.';
+    } else if (c == '.' || c == '\0') {
+      folder += '_';
+    } else {
+      folder += c;
+    }
+  }
+  if (folder.find_first_not_of('.') == std::string::npos) {
+    folder = "." + std::string(std::max<size_t>(label.size(), 1), '_');
+  }
+  return folder;
+}
+
+// Function to fingerprint a raw message by Message-ID, or by content if it has none.
+// The mbox "From " separator line is left out of the content hash. Never returns 0,
+// which marks empty slots.
+uint64_t messageFingerprint(const std::string& content) {
+  std::string message_id = extractMessageId(content);
+  uint64_t fingerprint;
+  if (!message_id.empty()) {
+    fingerprint = xxh64(message_id, 0);
+  } else {
+    size_t body_start = content.starts_with("From ") ? content.find('\n') + 1 : 0;
+    fingerprint = xxh64(std::string_view(content).substr(std::min(body_start, content.size())), kXXH64Prime1);
+  }
+  return fingerprint == 0 ? 1 : fingerprint;
+}
+
+// With --label-folders and --dedup-messages, the labels of a dropped copy are merged into
+// the copy that was kept. Saved copies are recorded by fingerprint with their path and
+// labels; the labels of dropped copies wait in merged_labels until their chunk is saved.
+struct KeptCopy {
+  std::string path;                 // Saved message file
+  std::vector<std::string> labels;  // Labels it is linked under
+};
+std::mutex label_merge_mutex;
+std::unordered_map<uint64_t, KeptCopy> kept_copies;
+std::vector<std::pair<uint64_t, std::vector<std::string>>> merged_labels;
+
+// Function to check (and record) whether a message was converted by an earlier
+// --incremental run or already seen in this run
+bool isDuplicateMessage(const std::string& content) {
+  if (!options.dedup_messages && !options.incremental) {
+    return false;
+  }
+  uint64_t fingerprint = messageFingerprint(content);
+  if (options.incremental && converted_messages.contains(fingerprint)) {
+    already_converted_dropped++;
+    return true;
+  }
+  // Fingerprints to persist for --incremental are collected once their messages are saved
+  if (!options.dedup_messages || seen_messages.insert(fingerprint)) {
+    return false;
+  }
+  duplicate_messages_dropped++;
+  if (options.label_folders) {
+    std::lock_guard<std::mutex> lock(label_merge_mutex);
+    merged_labels.emplace_back(fingerprint, extractGmailLabels(content));
+  }
+  return true;
+}
+
+std::atomic<uint64_t> input_bytes_dropped{0};
+
+// With --drop-input-cache, evicts the pages of a chunk file that the split has read past
+// from the page cache, every kInputDropInterval bytes and when the chunk is done, so a
+// long conversion does not push the other services' data out of memory. Pages are copied
+// into message strings as they are read, so they are never needed again. Only Linux
+// has the hints this needs; elsewhere the option does nothing.
+class InputCacheDropper {
+ public:
+  static const uint64_t kInputDropInterval = 16 * 1024 * 1024;
+  
+  explicit InputCacheDropper(const std::string& path) {
+#ifdef __linux__
+    if (options.drop_input_cache) {
+      fd_ = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+      if (fd_ >= 0) {
+        posix_fadvise(fd_, 0, 0, POSIX_FADV_SEQUENTIAL);
+      }
+    }
+#endif
+  }
+  
+  ~InputCacheDropper() {
+    if (fd_ >= 0) {
+      struct stat info;
+      if (fstat(fd_, &info) == 0) {
+        drop(info.st_size);
+      }
+      close(fd_);
+    }
+  }
+  
+  // Function to note that everything before offset has been read
+  void consumed(uint64_t offset) {
+    if (fd_ >= 0 && offset - dropped_ >= kInputDropInterval) {
+      drop(offset & ~uint64_t(4095));
+    }
+  }
+  
+ private:
+  void drop(uint64_t end) {
+#ifdef __linux__
+    if (end > dropped_ && posix_fadvise(fd_, dropped_, end - dropped_, POSIX_FADV_DONTNEED) == 0) {
+      input_bytes_dropped += end - dropped_;
+      dropped_ = end;
+    }
+#endif
+  }
+  
+  int fd_ = -1;
+  uint64_t dropped_ = 0;
+};
+
+// Function to split an mbox file into raw messages, calling handle(content, byte_offset)
+// for each one in file order
+void forEachRawMessage(const std::string& mbox_file,
+                       const std::function<void(const std::string&, uint64_t)>& handle) {
+  std::ifstream file(mbox_file);
+  std::string line;
+  std::string current;
+  uint64_t offset = 0;
+  uint64_t current_offset = 0;
+  InputCacheDropper dropper(mbox_file);
+
+  while (std::getline(file, line)) {
+    if (line.starts_with("From ")) { // use c++20 feature
+      // Start of a new email
+      if (!current.empty()) {
+        read_limiter.acquire(current.size());
+        handle(current, current_offset);
+      }
+      current = line + "\n";
+      current_offset = offset;
+      dropper.consumed(current_offset);
+    } else {
+      current += line + "\n";
+    }
+    offset += line.size() + 1;
+  }
+
+  // Add the last email
+  if (!current.empty()) {
+    read_limiter.acquire(current.size());
+    handle(current, current_offset);
+  }
+}
+
+// A message as split from its chunk, before parsing
+struct RawMessage {
+  std::string content;
+  uint64_t offset = 0;  // Byte offset in the chunk file
+  int number = 0;       // Global email number
+};
+
+// Function to split the mbox file into raw messages, dropping duplicates and numbering
+// the rest from first_number in file order. This is the serial part of a chunk: it
+// only looks at "From " lines and at the Message-ID for duplicate checks.
+std::vector<RawMessage> splitMessages(const std::string& mbox_file, int first_number) {
+  std::vector<RawMessage> messages;
+  forEachRawMessage(mbox_file, [&](const std::string& content, uint64_t offset) {
+    // Duplicates are dropped before any attachment parsing
+    if (isDuplicateMessage(content)) {
+      return;
+    }
+    messages.push_back({content, offset, first_number + static_cast<int>(messages.size())});
+  });
+  return messages;
+}
+
+// Function to parse a raw message: timestamp, attachments, labels. Runs on the workers.
+Email parseMessage(const RawMessage& raw) {
+  Email processed_email = extractAttachments(raw.content, raw.number);
+  processed_email.timestamp = extractEmailTimestamp(raw.content);
+  processed_email.source_offset = raw.offset;
+  processed_email.source_size = raw.content.size();
+  processed_email.number = raw.number;
+  if (options.label_folders) {
+    processed_email.labels = extractGmailLabels(raw.content);
+  }
+  if (options.incremental || (options.label_folders && options.dedup_messages)) {
+    processed_email.fingerprint = messageFingerprint(raw.content);
+  }
+  return processed_email;
+}
+
+// Progress of a chunk as recorded in the journal
+struct ChunkProgress {
+  bool completed = false;
+  int first_number = -1;  // Email number of the chunk's first message, -1 if never started
+  int count = 0;          // Messages extracted from the chunk
+  int next_number = 0;    // Global email counter after the chunk
+  std::unordered_map<uint64_t, int> saved;  // Byte offset -> email number of saved messages
+};
+
+// Function to record the messages of an already converted chunk as seen, so that
+// --dedup-messages drops their later copies after a resume skipped the chunk, and
+// --incremental persists the ones the journal shows were saved (all of them with
+// --pack, which journals whole chunks only)
+void rememberMessages(const std::string& mbox_file, const ChunkProgress& progress) {
+  forEachRawMessage(mbox_file, [&](const std::string& content, uint64_t offset) {
+    uint64_t fingerprint = messageFingerprint(content);
+    if (options.dedup_messages) {
+      seen_messages.insert(fingerprint);
+    }
+    if (options.incremental && (options.pack_attachments || progress.saved.count(offset))) {
+      delivered_messages.insert(fingerprint);
+    }
+  });
+}
+
+// Append-only journal of finished work that lets --resume skip it. One record per line:
+//   S <chunk> <first_number> <count> chunk started (count -1 until its split is done)
+//   M <chunk> <offset> <number>      message at byte offset saved as email <number>
+//   C <chunk> <next_number>          chunk finished
+// Every record is written as soon as it is made, so it survives a crash of the process;
+// message records are fsynced in batches, chunk records immediately.
+class Journal {
+ public:
+  static const int kSyncBatch = 4096;
+  
+  void open(const std::string& path, bool append) {
+    fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | (append ? 0 : O_TRUNC), 0644);
+    if (fd_ < 0) {
+      throw std::runtime_error("Failed to open journal " + path + ": " + strerror(errno));
+    }
+  }
+  
+  bool isOpen() const { return fd_ >= 0; }
+  
+  void recordChunkStart(const std::string& chunk, int first_number, int count) {
+    append("S " + chunk + " " + std::to_string(first_number) + " " + std::to_string(count) + "\n", true);
+  }
+  
+  void recordMessage(const std::string& chunk, uint64_t offset, int number) {
+    append("M " + chunk + " " + std::to_string(offset) + " " + std::to_string(number) + "\n", false);
+  }
+  
+  void recordChunkDone(const std::string& chunk, int next_number) {
+    append("C " + chunk + " " + std::to_string(next_number) + "\n", true);
+  }
+  
+  // Function to read a journal back into per-chunk progress
+  static std::map<std::string, ChunkProgress> load(const std::string& path) {
+    std::map<std::string, ChunkProgress> chunks;
+    std::ifstream in(path);
+    std::string line;
+    while (std::getline(in, line)) {
+      std::istringstream record(line);
+      char type;
+      std::string chunk;
+      record >> type;
+      if (!(record >> chunk)) continue; // Torn final line
+      ChunkProgress& progress = chunks[chunk];
+      if (type == 'S') {
+        record >> progress.first_number >> progress.count;
+      } else if (type == 'M') {
+        uint64_t offset;
+        int number;
+        if (record >> offset >> number) progress.saved[offset] = number;
+      } else if (type == 'C') {
+        if (record >> progress.next_number) progress.completed = true;
+      }
+    }
+    return chunks;
+  }
+  
+ private:
+  void append(const std::string& record, bool sync_now) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t written = 0;
+    while (written < record.size()) {
+      ssize_t n = ::write(fd_, record.data() + written, record.size() - written);
+      if (n < 0 && errno != EINTR) {
+        throw std::runtime_error("Failed to write journal: " + std::string(strerror(errno)));
+      }
+      if (n > 0) written += n;
+    }
+    if (sync_now || ++pending_ >= kSyncBatch) {
+      if (fsync(fd_) != 0) {
+        throw std::runtime_error("Failed to sync journal: " + std::string(strerror(errno)));
+      }
+      pending_ = 0;
+    }
+  }
+  
+  int fd_ = -1;
+  std::mutex mutex_;
+  int pending_ = 0;
+};
+
+Journal journal;
+const char* const kJournalFilename = "mbox2eml.journal";
+
+// Streams the output tree as a tar archive (ustar, with pax extended headers for long
+// names and huge files). Workers format complete entries in parallel; a single writer
+// thread emits them in order, so hardlinks always follow their targets.
+class TarWriter {
+ public:
+  TarWriter(int fd, size_t max_queued_bytes)
+      : fd_(fd), max_queued_bytes_(max_queued_bytes), mtime_(std::time(nullptr)),
+        writer_(&TarWriter::writerLoop, this) {}
+  
+  ~TarWriter() {
+    if (writer_.joinable()) {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        finished_ = true;
+      }
+      not_empty_.notify_one();
+      writer_.join();
+    }
+  }
+  
+  void addFile(const std::string& path, std::string_view data) {
+    file_limiter.acquire(1);
+    std::string entry = header(archiveName(path), data.size(), '0', "", 0644);
+    entry.append(data.data(), data.size());
+    entry.append(padding(data.size()), '\0');
+    enqueue(std::move(entry));
+  }
+  
+  void addDirectory(const std::string& path) {
+    enqueue(header(archiveName(path) + "/", 0, '5', "", 0755));
+  }
+  
+  void addHardLink(const std::string& target, const std::string& path) {
+    enqueue(header(archiveName(path), 0, '1', archiveName(target), 0644));
+  }
+  
+  // Function to write the end-of-archive marker and wait for the writer to drain
+  void finish() {
+    enqueue(std::string(1024, '\0'));
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      finished_ = true;
+    }
+    not_empty_.notify_one();
+    writer_.join();
+    if (error_) {
+      throw std::runtime_error("Failed to write tar stream: " + std::string(strerror(error_)));
+    }
+  }
+  
+ private:
+  static const size_t kBlockSize = 512;
+  
+  // Archive member names are relative, as if the output directory had been tarred
+  static std::string archiveName(const std::string& path) {
+    return fs::path(path).lexically_normal().relative_path().string();
+  }
+  
+  static size_t padding(size_t size) {
+    return (kBlockSize - size % kBlockSize) % kBlockSize;
+  }
+  
+  static void putOctal(char* field, size_t width, uint64_t value) {
+    snprintf(field, width, "%0*llo", static_cast<int>(width - 1), static_cast<unsigned long long>(value));
+  }
+  
+  // Function to append one "<length> <key>=<value>\n" pax record (the length counts itself)
+  static void paxRecord(std::string& records, const std::string& key, const std::string& value) {
+    size_t length = key.size() + value.size() + 3;
+    length += std::to_string(length).size();
+    if (std::to_string(length).size() + key.size() + value.size() + 3 != length) {
+      length++;
+    }
+    records += std::to_string(length) + " " + key + "=" + value + "\n";
+  }
+  
+  std::string ustarHeader(const std::string& name, const std::string& prefix, uint64_t size, char type,
+                          const std::string& link, int mode) {
+    std::string block(kBlockSize, '\0');
+    memcpy(&block[0], name.data(), std::min<size_t>(name.size(), 100));
+    putOctal(&block[100], 8, mode);
+    putOctal(&block[108], 8, 0);
+    putOctal(&block[116], 8, 0);
+    putOctal(&block[124], 12, size);
+    putOctal(&block[136], 12, mtime_);
+    block[156] = type;
+    memcpy(&block[157], link.data(), std::min<size_t>(link.size(), 100));
+    memcpy(&block[257], "ustar", 6);
+    memcpy(&block[263], "00", 2);
+    memcpy(&block[345], prefix.data(), std::min<size_t>(prefix.size(), 155));
+    
+    memset(&block[148], ' ', 8);
+    unsigned checksum = 0;
+    for (unsigned char c : block) checksum += c;
+    snprintf(&block[148], 8, "%06o", checksum);
+    block[155] = ' ';
+    return block;
+  }
+  
+  std::string header(const std::string& name, uint64_t size, char type, const std::string& link, int mode) {
+    std::string prefix;
+    std::string short_name = name;
+    if (name.size() > 100) {
+      // ustar can split a long path at a "/" into a 155-byte prefix and a 100-byte name
+      size_t split = name.find('/', name.size() > 101 ? name.size() - 101 : 0);
+      if (split != std::string::npos && split <= 155 && split > 0) {
+        prefix = name.substr(0, split);
+        short_name = name.substr(split + 1);
+      } else {
+        prefix.clear();
+      }
+    }
+    
+    std::string records;
+    if (short_name.size() > 100 || (prefix.empty() && name.size() > 100)) {
+      paxRecord(records, "path", name);
+      short_name = name.substr(0, 100);
+      prefix.clear();
+    }
+    if (link.size() > 100) {
+      paxRecord(records, "linkpath", link);
+    }
+    if (size > 077777777777ULL) {
+      paxRecord(records, "size", std::to_string(size));
+    }
+    if (records.empty()) {
+      return ustarHeader(short_name, prefix, size, type, link, mode);
+    }
+    
+    std::string entry = ustarHeader("PaxHeader", "", records.size(), 'x', "", 0644);
+    entry += records;
+    entry.append(padding(records.size()), '\0');
+    entry += ustarHeader(short_name, prefix, size > 077777777777ULL ? 0 : size, type, link.substr(0, 100), mode);
+    return entry;
+  }
+  
+  void enqueue(std::string&& entry) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    // Bound memory held by formatted entries; an oversized entry still goes through alone
+    not_full_.wait(lock, [&]() { return queued_bytes_ == 0 || queued_bytes_ + entry.size() <= max_queued_bytes_; });
+    queued_bytes_ += entry.size();
+    queue_.push_back(std::move(entry));
+    lock.unlock();
+    not_empty_.notify_one();
+  }
+  
+  void writerLoop() {
+    while (true) {
+      std::string entry;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_empty_.wait(lock, [&]() { return !queue_.empty() || finished_; });
+        if (queue_.empty()) return;
+        entry = std::move(queue_.front());
+        queue_.pop_front();
+        queued_bytes_ -= entry.size();
+      }
+      not_full_.notify_all();
+      
+      write_limiter.acquire(entry.size());
+      size_t written = 0;
+      while (written < entry.size() && !error_) {
+        ssize_t n = ::write(fd_, entry.data() + written, entry.size() - written);
+        if (n < 0 && errno != EINTR) {
+          error_ = errno;
+        } else if (n > 0) {
+          written += n;
+        }
+      }
+    }
+  }
+  
+  int fd_;
+  size_t max_queued_bytes_;
+  std::time_t mtime_;
+  std::mutex mutex_;
+  std::condition_variable not_empty_;
+  std::condition_variable not_full_;
+  std::deque<std::string> queue_;
+  size_t queued_bytes_ = 0;
+  bool finished_ = false;
+  int error_ = 0;
+  std::thread writer_;
+};
+
+// Set with --tar: all output goes into the stream instead of the filesystem
+std::unique_ptr<TarWriter> tar_writer;
+const size_t kTarMaxQueuedBytes = 256 * 1024 * 1024;
+
+// Function to create Maildir structure with attachments directory
+void createMaildirStructure(const std::string& output_dir) {
+  if (tar_writer) {
+    for (const char* dir : {"", "/cur", "/new", "/tmp", "/attachments"}) {
+      tar_writer->addDirectory(output_dir + dir);
+    }
+    return;
+  }
+  
+  try {
+    // Create main output directory if it doesn't exist
+    fs::create_directories(output_dir);
+    
+    // Create Maildir subdirectories
+    fs::create_directory(output_dir + "/cur");
+    fs::create_directory(output_dir + "/new");
+    fs::create_directory(output_dir + "/tmp");
+    
+    // Create attachments directory
+    fs::create_directory(output_dir + "/attachments");
+    
+    std::cout << "Created Maildir structure with attachments directory in " << output_dir << std::endl;
+  } catch (const std::exception& e) {
+    std::cerr << "Error creating Maildir structure: " << e.what() << std::endl;
+    throw;
+  }
+}
+
+// Function to find and sort chunk files
+std::vector<std::string> findChunkFiles(const std::string& input_dir) {
+  std::vector<std::pair<int, std::string>> chunk_files;
+  std::regex chunk_pattern(R"(chunk_(\d+)\.mbox)");
+  
+  try {
+    for (const auto& entry : fs::directory_iterator(input_dir)) {
+      if (entry.is_regular_file()) {
+        std::string filename = entry.path().filename().string();
+        std::smatch match;
+        
+        if (std::regex_match(filename, match, chunk_pattern)) {
+          int chunk_number = std::stoi(match[1].str());
+          chunk_files.emplace_back(chunk_number, entry.path().string());
+        }
+      }
+    }
+  } catch (const std::exception& e) {
+    std::cerr << "Error reading directory: " << e.what() << std::endl;
+  }
+  
+  // Sort by chunk number
+  std::sort(chunk_files.begin(), chunk_files.end());
+  
+  // Extract just the file paths
+  std::vector<std::string> sorted_files;
+  for (const auto& pair : chunk_files) {
+    sorted_files.push_back(pair.second);
+  }
+  
+  return sorted_files;
+}
+
+// Index of the worker thread running the current task
+thread_local int current_worker = 0;
+
+// Persistent pool of worker threads, created once per run. Each worker owns a deque of
+// tasks: it takes from the front of its own deque, in submission order, and when that is
+// empty steals from the back of the others, so one worker stuck on a huge message never
+// leaves the rest idle. Workers are numbered from first_worker for current_worker.
+class WorkStealingPool {
+ public:
+  explicit WorkStealingPool(int num_workers, int first_worker = 0) : first_worker_(first_worker) {
+    for (int i = 0; i < num_workers; ++i) {
+      queues_.push_back(std::make_unique<Queue>());
+    }
+    for (int i = 0; i < num_workers; ++i) {
+      threads_.emplace_back(&WorkStealingPool::workerLoop, this, i);
+    }
+  }
+  
+  ~WorkStealingPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    wake_.notify_all();
+    for (auto& thread : threads_) {
+      thread.join();
+    }
+  }
+  
+  int size() const { return threads_.size(); }
+  
+  // Function to queue a task. Tasks from a worker go to its own deque; others are dealt
+  // out round-robin.
+  void submit(std::function<void()> task) {
+    size_t index = owner_ == this ? current_worker - first_worker_ : next_queue_++ % queues_.size();
+    pending_++;
+    {
+      std::lock_guard<std::mutex> lock(queues_[index]->mutex);
+      queues_[index]->tasks.push_back(std::move(task));
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      queued_++;
+    }
+    wake_.notify_one();
+  }
+  
+  // Function to wait until every submitted task has finished
+  void waitIdle() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    idle_.wait(lock, [this] { return pending_ == 0; });
+  }
+  
+  long tasksStolen() const { return stolen_; }
+  
+ private:
+  struct Queue {
+    std::mutex mutex;
+    std::deque<std::function<void()>> tasks;
+  };
+  
+  // Function to take a task: the oldest of our own, else the newest of another worker's
+  bool takeTask(int index, std::function<void()>& task) {
+    for (size_t i = 0; i < queues_.size(); ++i) {
+      Queue& queue = *queues_[(index + i) % queues_.size()];
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      if (queue.tasks.empty()) continue;
+      if (i == 0) {
+        task = std::move(queue.tasks.front());
+        queue.tasks.pop_front();
+      } else {
+        task = std::move(queue.tasks.back());
+        queue.tasks.pop_back();
+        stolen_++;
+      }
+      return true;
+    }
+    return false;
+  }
+  
+  void workerLoop(int index) {
+    owner_ = this;
+    current_worker = first_worker_ + index;
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        wake_.wait(lock, [this] { return queued_ > 0 || stopping_; });
+        if (queued_ == 0) return;  // Stopping
+        queued_--;
+      }
+      // A task is reserved for us, but another worker may take it first; keep looking
+      std::function<void()> task;
+      while (!takeTask(index, task)) {
+        std::this_thread::yield();
+      }
+      try {
+        task();
+      } catch (const std::exception& e) {
+        std::cerr << "Error in worker " << index << ": " << e.what() << std::endl;
+      }
+      if (--pending_ == 0) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        idle_.notify_all();
+      }
+    }
+  }
+  
+  static thread_local WorkStealingPool* owner_;
+  int first_worker_;
+  std::vector<std::unique_ptr<Queue>> queues_;
+  std::vector<std::thread> threads_;
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::condition_variable idle_;
+  size_t queued_ = 0;               // Tasks in the deques not yet reserved by a worker
+  std::atomic<size_t> pending_{0};  // Tasks submitted and not yet finished
+  std::atomic<size_t> next_queue_{0};
+  std::atomic<long> stolen_{0};
+  bool stopping_ = false;
+};
+
+thread_local WorkStealingPool* WorkStealingPool::owner_ = nullptr;
+WorkStealingPool* work_pool = nullptr;
+// Separate lane for messages of at least options.big_message_size bytes, with its own threads
+WorkStealingPool* big_message_pool = nullptr;
+
+// Bounded lock-free multi-producer multi-consumer ring buffer (Vyukov's design). Each
+// cell carries a sequence number that tells producers and consumers whose turn it is, so
+// push and pop are a single compare-and-swap when the queue is neither full nor empty.
+// Blocked callers sleep on an atomic counter (a futex on Linux), and are only woken
+// when someone is actually waiting. Depth and wait counts are kept for the end-of-run report.
+template <typename T>
+class BoundedQueue {
+ public:
+  explicit BoundedQueue(size_t capacity) {
+    size_t size = 1;
+    while (size < capacity) size <<= 1;
+    mask_ = size - 1;
+    cells_ = std::make_unique<Cell[]>(size);
+    for (size_t i = 0; i < size; ++i) {
+      cells_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+  
+  // Function to add an item, waiting while the queue is full
+  void push(T item) {
+    if (!tryPush(item)) {
+      push_waits_++;
+      waitFor(space_version_, space_waiters_, [&] { return tryPush(item); });
+    }
+    size_t depth = enqueue_pos_.load(std::memory_order_relaxed) - dequeue_pos_.load(std::memory_order_relaxed);
+    pushes_++;
+    depth_sum_ += depth;
+    size_t max_depth = max_depth_.load(std::memory_order_relaxed);
+    while (depth > max_depth && !max_depth_.compare_exchange_weak(max_depth, depth)) {}
+    signal(item_version_, item_waiters_);
+  }
+  
+  // Function to take an item, waiting while the queue is empty; returns false once the
+  // queue is closed and drained
+  bool pop(T& item) {
+    if (!tryPop(item)) {
+      pop_waits_++;
+      bool popped = false;
+      waitFor(item_version_, item_waiters_, [&] {
+        if (tryPop(item)) return popped = true;
+        if (!closed_.load()) return false;
+        // The last push may have landed between the empty tryPop and seeing closed_
+        popped = tryPop(item);
+        return true;
+      });
+      if (!popped) return false;
+    }
+    signal(space_version_, space_waiters_);
+    return true;
+  }
+  
+  // Function to tell consumers that no more items will come
+  void close() {
+    closed_.store(true);
+    item_version_.fetch_add(1);
+    item_version_.notify_all();
+  }
+  
+  // Function to describe the queue's load: the stage that waits more is the faster one
+  std::string report() const {
+    std::ostringstream out;
+    out << pushes_ << " items, mean depth " << (pushes_ ? depth_sum_ / pushes_ : 0) << "/" << mask_ + 1
+        << ", max depth " << max_depth_ << ", producer waits (queue full) " << push_waits_
+        << ", consumer waits (queue empty) " << pop_waits_;
+    return out.str();
+  }
+  
+ private:
+  struct Cell {
+    std::atomic<size_t> sequence;
+    T value;
+  };
+  
+  bool tryPush(T& item) {
+    size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+    while (true) {
+      Cell& cell = cells_[pos & mask_];
+      size_t sequence = cell.sequence.load(std::memory_order_acquire);
+      intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+      if (diff == 0) {
+        if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          cell.value = std::move(item);
+          cell.sequence.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;  // Full
+      } else {
+        pos = enqueue_pos_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+  
+  bool tryPop(T& item) {
+    size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+    while (true) {
+      Cell& cell = cells_[pos & mask_];
+      size_t sequence = cell.sequence.load(std::memory_order_acquire);
+      intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos + 1);
+      if (diff == 0) {
+        if (dequeue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          item = std::move(cell.value);
+          cell.sequence.store(pos + mask_ + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;  // Empty
+      } else {
+        pos = dequeue_pos_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+  
+  // Waiters register before reading the version, and signallers bump the version before
+  // checking for waiters, so a wakeup is never lost
+  template <typename Ready>
+  static void waitFor(std::atomic<uint32_t>& version, std::atomic<int>& waiters, Ready ready) {
+    waiters++;
+    while (true) {
+      uint32_t seen = version.load();
+      if (ready()) break;
+      version.wait(seen);
+    }
+    waiters--;
+  }
+  
+  static void signal(std::atomic<uint32_t>& version, std::atomic<int>& waiters) {
+    version.fetch_add(1);
+    if (waiters.load() > 0) {
+      version.notify_all();
+    }
+  }
+  
+  std::unique_ptr<Cell[]> cells_;
+  size_t mask_;
+  alignas(64) std::atomic<size_t> enqueue_pos_{0};
+  alignas(64) std::atomic<size_t> dequeue_pos_{0};
+  alignas(64) std::atomic<uint32_t> item_version_{0};
+  std::atomic<int> item_waiters_{0};
+  alignas(64) std::atomic<uint32_t> space_version_{0};
+  std::atomic<int> space_waiters_{0};
+  std::atomic<bool> closed_{false};
+  std::atomic<size_t> pushes_{0};
+  std::atomic<size_t> depth_sum_{0};
+  std::atomic<size_t> max_depth_{0};
+  std::atomic<size_t> push_waits_{0};
+  std::atomic<size_t> pop_waits_{0};
+};
+
+// Target size of a batch of small messages scheduled as one pool task
+const uint64_t kBatchBytes = 1024 * 1024;
+
+// Function to run process(i) for every message of a chunk, given the message sizes.
+// On the pool, messages are queued largest first, so the biggest ones never start last:
+// large messages go alone, small ones are grouped up to kBatchBytes, and idle workers
+// steal queued batches. Messages of at least --big-messages bytes go to their own lane.
+// With --scheduler=static, the range is split into equal-count slices, one fresh thread each.
+void runBatches(const std::vector<uint64_t>& sizes, int num_threads, const std::function<void(int)>& process) {
+  int count = sizes.size();
+  if (work_pool != nullptr) {
+    std::vector<int> order(count);
+    for (int i = 0; i < count; ++i) order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return sizes[a] > sizes[b]; });
+    
+    size_t start = 0;
+    while (start < order.size()) {
+      WorkStealingPool* pool = work_pool;
+      if (big_message_pool != nullptr && sizes[order[start]] >= options.big_message_size) {
+        pool = big_message_pool;
+      }
+      size_t end = start;
+      uint64_t batch_bytes = 0;
+      while (end < order.size() && (end == start || (batch_bytes < kBatchBytes && pool == work_pool))) {
+        batch_bytes += sizes[order[end++]];
+      }
+      std::vector<int> batch(order.begin() + start, order.begin() + end);
+      pool->submit([&process, batch = std::move(batch)] {
+        for (int i : batch) process(i);
+      });
+      start = end;
+    }
+    if (big_message_pool != nullptr) {
+      big_message_pool->waitIdle();
+    }
+    work_pool->waitIdle();
+    return;
+  }
+  
+  int per_thread = count / num_threads;
+  int remaining = count % num_threads;
+  std::vector<std::thread> threads;
+  int start_index = 0;
+  for (int i = 0; i < num_threads; ++i) {
+    int end_index = start_index + per_thread + (i < remaining ? 1 : 0);
+    threads.emplace_back([&process, i, start_index, end_index] {
+      current_worker = i;
+      for (int index = start_index; index < end_index; ++index) process(index);
+    });
+    start_index = end_index;
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+}
+
+// Messages waiting to be parsed, per chunk; bounds the raw text held in memory
+const size_t kParseQueueCapacity = 1024;
+
+// Messages the split holds back to queue the largest of them first
+const size_t kReorderWindowMessages = 256;
+const uint64_t kReorderWindowBytes = 64 * 1024 * 1024;
+
+// A raw message on its way to a parser, with the slot its parsed form goes to (none
+// when it is saved right away)
+struct ParseJob {
+  RawMessage raw;
+  Email* target = nullptr;
+};
+
+// Function to split and parse a chunk as a pipeline: the calling thread splits it,
+// drops duplicates and numbers the messages (as splitMessages does), pushing them
+// into a bounded queue that pool workers parse from while the split goes on. Within a
+// window of the last kReorderWindowMessages messages (kReorderWindowBytes at most), the
+// largest are queued first, as runBatches does for a whole chunk. Messages of at least
+// --big-messages bytes go through their own queue to the big-message lane.
+// Given save, the worker that parsed a message saves it right away, so the whole chunk
+// is never held in memory; otherwise the parsed messages are returned in file order.
+// count is set to the number of messages either way.
+std::vector<Email> splitAndParse(const std::string& mbox_file, int first_number, int& count,
+                                 const std::function<void(const Email&)>& save = nullptr) {
+  // A deque keeps parsed slots in place while the reader appends new ones
+  std::deque<Email> parsed;
+  BoundedQueue<ParseJob> queue(kParseQueueCapacity);
+  BoundedQueue<ParseJob> big_queue(kParseQueueCapacity);
+  count = 0;
+  
+  auto parseFrom = [&save](BoundedQueue<ParseJob>& source) {
+    ParseJob job;
+    while (source.pop(job)) {
+      if (job.target != nullptr) {
+        *job.target = parseMessage(job.raw);
+        job = ParseJob();
+      } else {
+        // The raw text is let go before the save, which may wait for the I/O stage
+        Email email = parseMessage(job.raw);
+        job = ParseJob();
+        save(email);
+      }
+    }
+  };
+  for (int i = 0; i < work_pool->size(); ++i) {
+    work_pool->submit([&] { parseFrom(queue); });
+  }
+  if (big_message_pool != nullptr) {
+    for (int i = 0; i < big_message_pool->size(); ++i) {
+      big_message_pool->submit([&] { parseFrom(big_queue); });
+    }
+  }
+  
+  // Messages held back by the split, as a max-heap on their size
+  std::vector<ParseJob> window;
+  uint64_t window_bytes = 0;
+  auto smaller = [](const ParseJob& a, const ParseJob& b) { return a.raw.content.size() < b.raw.content.size(); };
+  auto queueLargest = [&] {
+    std::pop_heap(window.begin(), window.end(), smaller);
+    ParseJob job = std::move(window.back());
+    window.pop_back();
+    window_bytes -= job.raw.content.size();
+    bool big = big_message_pool != nullptr && job.raw.content.size() >= options.big_message_size;
+    (big ? big_queue : queue).push(std::move(job));
+  };
+  
+  try {
+    forEachRawMessage(mbox_file, [&](const std::string& content, uint64_t offset) {
+      // Duplicates are dropped before any attachment parsing
+      if (isDuplicateMessage(content)) {
+        return;
+      }
+      ParseJob& job = window.emplace_back();
+      job.raw = {content, offset, first_number + count++};
+      if (!save) {
+        job.target = &parsed.emplace_back();
+      }
+      window_bytes += content.size();
+      std::push_heap(window.begin(), window.end(), smaller);
+      while (window.size() > kReorderWindowMessages || window_bytes > kReorderWindowBytes) {
+        queueLargest();
+      }
+    });
+    while (!window.empty()) {
+      queueLargest();
+    }
+  } catch (...) {
+    // The parsers refer to the queues; let them drain before unwinding
+    queue.close();
+    big_queue.close();
+    if (big_message_pool != nullptr) big_message_pool->waitIdle();
+    work_pool->waitIdle();
+    throw;
+  }
+  queue.close();
+  big_queue.close();
+  if (big_message_pool != nullptr) {
+    big_message_pool->waitIdle();
+  }
+  work_pool->waitIdle();
+  std::cout << "Parse queue: " << queue.report() << std::endl;
+  if (big_message_pool != nullptr) {
+    std::cout << "Big-message parse queue: " << big_queue.report() << std::endl;
+  }
+  
+  return std::vector<Email>(std::make_move_iterator(parsed.begin()), std::make_move_iterator(parsed.end()));
+}
+
+// Attachments at least this large are split into independent blocks that are
+// compressed in parallel, pigz-style. Each block becomes its own gzip member and
+// the concatenated members still form a single valid .gz file (RFC 1952).
+const size_t kParallelCompressThreshold = 4 * 1024 * 1024;
+const size_t kCompressBlockSize = 1024 * 1024;
+
+// Function to compress data using gzip
+std::string compressGzip(std::string_view data) {
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  
+  // Use faster compression level for better throughput in multi-threaded scenario
   if (deflateInit2(&zs, Z_BEST_SPEED, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
     throw std::runtime_error("deflateInit2 failed");
   }
   
-  zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
-  zs.avail_in = data.size();
+  zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+  zs.avail_in = data.size();
+  
+  int ret;
+  char outbuffer[32768];
+  std::string compressed;
+  
+  do {
+    zs.next_out = reinterpret_cast<Bytef*>(outbuffer);
+    zs.avail_out = sizeof(outbuffer);
+    
+    ret = deflate(&zs, Z_FINISH);
+    
+    if (compressed.size() < zs.total_out) {
+      compressed.append(outbuffer, zs.total_out - compressed.size());
+    }
+  } while (ret == Z_OK);
+  
+  deflateEnd(&zs);
+  
+  if (ret != Z_STREAM_END) {
+    throw std::runtime_error("Error during compression");
+  }
+  
+  return compressed;
+}
+
+// Helper threads started by compressGzipParallel outside the pool, across all callers
+std::atomic<size_t> compress_helper_threads{0};
+// Blocks compressed by helpers rather than by the thread that asked for them
+std::atomic<long> compress_blocks_helped{0};
+
+// Function to compress large data as parallel gzip members (falls back to compressGzip for small data)
+std::string compressGzipParallel(const std::string& data) {
+  if (data.size() < kParallelCompressThreshold) {
+    return compressGzip(data);
+  }
+  
+  // Helpers may start after the caller is done with the blocks, so the state they share
+  // is reference counted and they only touch the data after claiming a block
+  struct BlockState {
+    std::string_view data;
+    std::vector<std::string> members;
+    std::atomic<size_t> next_block{0};
+    size_t blocks_done = 0;
+    std::exception_ptr error;
+    std::mutex mutex;
+    std::condition_variable done;
+  };
+  auto state = std::make_shared<BlockState>();
+  state->data = data;
+  size_t num_blocks = (data.size() + kCompressBlockSize - 1) / kCompressBlockSize;
+  state->members.resize(num_blocks);
+  
+  // Threads pull block indices until all blocks are compressed
+  auto compressBlocks = [state, num_blocks](bool helper) {
+    size_t block;
+    while ((block = state->next_block.fetch_add(1)) < num_blocks) {
+      std::exception_ptr error;
+      try {
+        std::string_view slice = state->data.substr(block * kCompressBlockSize, kCompressBlockSize);
+        state->members[block] = compressGzip(slice);
+        if (helper) compress_blocks_helped++;
+      } catch (...) {
+        error = std::current_exception();
+      }
+      std::lock_guard<std::mutex> lock(state->mutex);
+      if (error && !state->error) state->error = error;
+      if (++state->blocks_done == num_blocks) state->done.notify_all();
+    }
+  };
+  
+  // Inside the pool, idle workers join in; otherwise helper threads are started. In the
+  // parse-and-save pipeline, the parsers pick up the helper tasks once the parse queue
+  // is closed and drained, so a large attachment at the end of a chunk is still spread
+  // over the workers; blocks left by then are already done and the tasks return at once.
+  std::vector<std::thread> helpers;
+  if (work_pool != nullptr) {
+    size_t num_helpers = std::min<size_t>(work_pool->size(), num_blocks) - 1;
+    for (size_t i = 0; i < num_helpers; ++i) {
+      work_pool->submit([compressBlocks] { compressBlocks(true); });
+    }
+  } else {
+    // The slices of --scheduler=static may all compress at once, so their helpers share
+    // one budget of --threads minus one threads
+    size_t num_threads = options.threads > 0 ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+    size_t wanted = std::min(num_threads, num_blocks) - 1;
+    size_t running = compress_helper_threads.load();
+    size_t granted;
+    do {
+      granted = std::min(wanted, num_threads - 1 - std::min(running, num_threads - 1));
+    } while (!compress_helper_threads.compare_exchange_weak(running, running + granted));
+    for (size_t i = 0; i < granted; ++i) {
+      helpers.emplace_back(compressBlocks, true);
+    }
+  }
+  compressBlocks(false); // The calling thread compresses blocks too
+  for (auto& helper : helpers) {
+    helper.join();
+  }
+  compress_helper_threads -= helpers.size();
+  {
+    // Only blocks already claimed by helpers can still be in progress
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->done.wait(lock, [&] { return state->blocks_done == num_blocks; });
+  }
+  
+  if (state->error) {
+    std::rethrow_exception(state->error);
+  }
+  const std::vector<std::string>& members = state->members;
+  
+  size_t total_size = 0;
+  for (const auto& member : members) {
+    total_size += member.size();
+  }
+  std::string compressed;
+  compressed.reserve(total_size);
+  for (const auto& member : members) {
+    compressed += member;
+  }
+  return compressed;
+}
+
+// An output directory held open, so files are created in it with openat() instead of
+// resolving the whole path again for every file. In --tar mode only the path is set.
+struct OutputDirectory {
+  std::string path;
+  int fd = -1;
+};
+
+// Function to get the path of a file named relative to an output directory, if given
+std::string outputPath(const OutputDirectory* dir, const std::string& name) {
+  return dir != nullptr ? dir->path + "/" + name : name;
+}
+
+// A file write or hardlink prepared on a CPU worker for the I/O pool
+struct FileOp {
+  enum Kind { kWrite, kLink } kind;
+  std::string path;
+  std::string data;    // kWrite: the file contents
+  std::string target;  // kLink: the existing file to link to; kWrite: where to rename the
+                       // written file to, if anywhere
+  // When set, path (and target for a rename) are names relative to these directories
+  const OutputDirectory* dir = nullptr;
+  const OutputDirectory* target_dir = nullptr;
+  
+  std::string fullPath() const { return outputPath(dir, path); }
+};
+
+// File writes and links of one message, prepared on a CPU worker and carried out on an
+// I/O worker: all writes first, then the renames, then the links, which only point at
+// files written before them
+struct FileOps {
+  std::vector<FileOp> ops;
+  size_t bytes = 0;
+};
+
+// Set while a CPU worker prepares a message for the I/O pool; writes and links are then
+// recorded here instead of being made
+thread_local FileOps* deferred_file_ops = nullptr;
+
+// Function to create a file (relative to dir, if given) and write all of data to it
+// with write(2), syncing it if asked; returns the still open descriptor
+int createFileAt(const OutputDirectory* dir, const std::string& name, std::string_view data, bool sync) {
+  file_limiter.acquire(1);
+  write_limiter.acquire(data.size());
+  int fd = openat(dir != nullptr ? dir->fd : AT_FDCWD, name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    throw std::runtime_error("Failed to create output file: " + outputPath(dir, name) + ": " + strerror(errno));
+  }
+  size_t written = 0;
+  while (written < data.size()) {
+    ssize_t result = write(fd, data.data() + written, data.size() - written);
+    if (result < 0 && errno == EINTR) {
+      continue;
+    }
+    if (result <= 0) {
+      close(fd);
+      throw std::runtime_error("Failed to write data to: " + outputPath(dir, name));
+    }
+    written += result;
+  }
+  if (sync && fsync(fd) != 0) {
+    close(fd);
+    throw std::runtime_error("Failed to write data to: " + outputPath(dir, name));
+  }
+  return fd;
+}
+
+// Function to close a file written by createFileAt
+void closeFileAt(int fd, const OutputDirectory* dir, const std::string& name) {
+  if (close(fd) != 0) {
+    throw std::runtime_error("Failed to write data to: " + outputPath(dir, name));
+  }
+}
+
+std::atomic<uint64_t> output_files_dropped{0};
+
+// How a written file is flushed before the directories of its batch are synced
+enum FileFlush {
+  kFlushNone,      // --durability=none
+  kFlushDataSync,  // --durability=batched: start writeback of the whole batch, then fdatasync each file
+  kFlushFsync,     // --durability=strict: fsync the file as soon as it is written
+};
+
+// Function to get the per-file flush of the --durability level. Batched mode starts the
+// writeback of every file in the batch before waiting on any of them, so the files go
+// to disk in parallel, and each is then made durable with its own fdatasync; only that
+// holds on every filesystem. Outside Linux (no sync_file_range) it fsyncs each file.
+FileFlush fileFlush() {
+  switch (options.durability) {
+    case kDurabilityNone: return kFlushNone;
+#ifdef __linux__
+    case kDurabilityBatched: return kFlushDataSync;
+#endif
+    default: return kFlushFsync;
+  }
+}
+
+// Function to start writing a file back to disk right away, rather than leaving its pages
+// dirty until the kernel's flusher threads pile them up into one large writeback
+void startWriteback(int fd) {
+#ifdef __linux__
+  sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+#endif
+}
+
+// Function to wait until a file's data is written back, so its pages can be evicted
+void finishWriteback(int fd) {
+#ifdef __linux__
+  sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+#endif
+}
+
+// Function to evict the written back pages of a file from the page cache
+// (--drop-output-cache; does nothing outside Linux)
+void dropWrittenPages(int fd) {
+#ifdef __linux__
+  if (posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) == 0) {
+    output_files_dropped++;
+  }
+#endif
+}
+
+// Function to finish a file written by createFileAt: fdatasync it if its flush asks for
+// it, or else wait for its writeback if --drop-output-cache needs clean pages, then close it
+void finishFileAt(int fd, const OutputDirectory* dir, const std::string& name, FileFlush flush) {
+  if (flush == kFlushDataSync && fdatasync(fd) != 0) {
+    int error = errno;
+    close(fd);
+    throw std::runtime_error("Failed to sync " + outputPath(dir, name) + ": " + strerror(error));
+  }
+  if (options.drop_output_cache) {
+    if (flush == kFlushNone) {
+      finishWriteback(fd);
+    }
+    dropWrittenPages(fd);
+  }
+  closeFileAt(fd, dir, name);
+}
+
+// Function to create a file (relative to dir, if given) and write all of data to it
+// with write(2), flushing it as asked
+void writeFileAt(const OutputDirectory* dir, const std::string& name, std::string_view data, FileFlush flush) {
+  int fd = createFileAt(dir, name, data, flush == kFlushFsync);
+  finishFileAt(fd, dir, name, flush);
+}
+
+// Function to write a complete output file right away
+void writeOutputFileNow(const std::string& path, std::string_view data) {
+  if (tar_writer) {
+    tar_writer->addFile(path, data);
+    return;
+  }
+  writeFileAt(nullptr, path, data, kFlushNone);
+}
+
+// Function to write a complete output file, or to queue the write for the I/O pool
+void writeOutputFile(const std::string& path, std::string&& data) {
+  if (deferred_file_ops == nullptr) {
+    writeOutputFileNow(path, data);
+    return;
+  }
+  deferred_file_ops->bytes += data.size();
+  deferred_file_ops->ops.push_back({FileOp::kWrite, path, std::move(data), ""});
+}
+
+void writeOutputFile(const std::string& path, std::string_view data) {
+  if (deferred_file_ops == nullptr) {
+    writeOutputFileNow(path, data);
+  } else {
+    writeOutputFile(path, std::string(data));
+  }
+}
+
+// Function to write a complete output file named relative to an open directory, or to
+// queue the write for the I/O pool
+void writeOutputFileAt(const OutputDirectory& dir, const std::string& name, std::string data) {
+  if (tar_writer) {
+    tar_writer->addFile(dir.path + "/" + name, data);
+  } else if (deferred_file_ops == nullptr) {
+    writeFileAt(&dir, name, data, kFlushNone);
+  } else {
+    deferred_file_ops->bytes += data.size();
+    deferred_file_ops->ops.push_back({FileOp::kWrite, name, std::move(data), "", &dir});
+  }
+}
+
+// Function to hardlink an output file under a second name, replacing any existing file
+void linkOutputFile(const std::string& target, const std::string& link_path) {
+  if (deferred_file_ops != nullptr) {
+    deferred_file_ops->ops.push_back({FileOp::kLink, link_path, "", target});
+    return;
+  }
+  if (tar_writer) {
+    tar_writer->addHardLink(target, link_path);
+    return;
+  }
+  fs::remove(link_path);
+  fs::create_hard_link(target, link_path);
+}
+
+// The cur/ and tmp/ directories of a Maildir or Maildir++ folder
+struct MaildirDirectories {
+  const OutputDirectory* cur;
+  const OutputDirectory* tmp;
+};
+
+// Function to deliver a message file the Maildir way: write it into tmp/, then rename it
+// into cur/, so a crash or a reader never sees a partly written message there
+void deliverMessageFile(const MaildirDirectories& dirs, const std::string& name, std::string data) {
+  if (tar_writer) {
+    tar_writer->addFile(dirs.cur->path + "/" + name, data);
+    return;
+  }
+  // Outside --tar, messages are only saved by processEmail, which hands their files to
+  // the I/O stage; it syncs and renames them with the rest of their batch
+  deferred_file_ops->bytes += data.size();
+  deferred_file_ops->ops.push_back({FileOp::kWrite, name, std::move(data), name, dirs.tmp, dirs.cur});
+}
+
+// Function to compress small data as a zlib stream primed with the shared dictionary
+std::string compressWithDictionary(std::string_view data) {
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  
+  // Small files are cheap to compress, so spend a little more effort finding dictionary matches
+  if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    throw std::runtime_error("deflateInit2 failed");
+  }
+  if (deflateSetDictionary(&zs, reinterpret_cast<const Bytef*>(compression_dictionary.data()),
+                           compression_dictionary.size()) != Z_OK) {
+    deflateEnd(&zs);
+    throw std::runtime_error("deflateSetDictionary failed");
+  }
+  
+  std::string compressed(deflateBound(&zs, data.size()), '\0');
+  zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+  zs.avail_in = data.size();
+  zs.next_out = reinterpret_cast<Bytef*>(compressed.data());
+  zs.avail_out = compressed.size();
+  
+  int ret = deflate(&zs, Z_FINISH);
+  compressed.resize(zs.total_out);
+  deflateEnd(&zs);
+  
+  if (ret != Z_STREAM_END) {
+    throw std::runtime_error("Error during dictionary compression");
+  }
+  
+  dictionary_compressed_files++;
+  return compressed;
+}
+
+// Function to train a compression dictionary from a sample of stripped emails.
+// Lines that repeat across messages (Gmail headers, newsletter templates, signatures)
+// are scored by the bytes they would save and the best ones are packed into the
+// dictionary, most valuable last since zlib matches nearer data more cheaply.
+std::string trainDictionary(const std::vector<Email>& emails) {
+  std::unordered_map<std::string_view, size_t> line_counts;
+  size_t sampled = 0;
+  
+  for (const auto& email : emails) {
+    if (sampled >= kDictSampleSize) break;
+    std::string_view content(email.content);
+    sampled += content.size();
+    
+    size_t line_start = 0;
+    while (line_start < content.size()) {
+      size_t line_end = content.find('\n', line_start);
+      if (line_end == std::string_view::npos) line_end = content.size();
+      std::string_view line = content.substr(line_start, line_end - line_start + 1);
+      if (line.size() >= 8 && line.size() <= 256) {
+        line_counts[line]++;
+      }
+      line_start = line_end + 1;
+    }
+  }
+  
+  std::vector<std::pair<size_t, std::string_view>> scored_lines;
+  for (const auto& [line, count] : line_counts) {
+    if (count > 1) {
+      scored_lines.emplace_back((count - 1) * line.size(), line);
+    }
+  }
+  std::sort(scored_lines.begin(), scored_lines.end(), std::greater<>());
+  
+  std::vector<std::string_view> chosen;
+  size_t dictionary_size = 0;
+  for (const auto& [score, line] : scored_lines) {
+    if (dictionary_size + line.size() > kDictMaxSize) continue;
+    chosen.push_back(line);
+    dictionary_size += line.size();
+  }
+  
+  std::string dictionary;
+  dictionary.reserve(dictionary_size);
+  for (auto it = chosen.rbegin(); it != chosen.rend(); ++it) {
+    dictionary += *it;
+  }
+  return dictionary;
+}
+
+// Function to read a stored dictionary. Training never writes an empty or oversized
+// one, so such a file is damaged, and decoding with it would fail or silently differ.
+std::string readDictionary(const std::string& path) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    throw std::runtime_error("Failed to open " + path);
+  }
+  std::string dictionary(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>{});
+  if (dictionary.empty() || dictionary.size() > kDictMaxSize) {
+    throw std::runtime_error("Damaged dictionary " + path + " (" + std::to_string(dictionary.size()) + " bytes)");
+  }
+  return dictionary;
+}
+
+// Function to load the shared dictionary from the output root, or train and store a new
+// one. A new dictionary is written to a temporary file, synced and renamed into place,
+// so a crash never leaves a partial dictionary for the .zd files of a later run.
+void prepareDictionary(const std::vector<Email>& sample, const std::string& output_dir) {
+  std::string dictionary_path = output_dir + "/" + kDictionaryFilename;
+  
+  if (!tar_writer && fs::exists(dictionary_path)) {
+    compression_dictionary = readDictionary(dictionary_path);
+    std::cout << "Loaded " << compression_dictionary.size() << " byte dictionary from " << dictionary_path << std::endl;
+    return;
+  }
+  
+  compression_dictionary = trainDictionary(sample);
+  if (tar_writer) {
+    writeOutputFile(dictionary_path, compression_dictionary);
+  } else {
+    writeOutputFile(dictionary_path + ".tmp", compression_dictionary);
+    syncIfDurable(dictionary_path + ".tmp");
+    fs::rename(dictionary_path + ".tmp", dictionary_path);
+    syncIfDurable(output_dir);
+  }
+  std::cout << "Trained " << compression_dictionary.size() << " byte dictionary, saved to " << dictionary_path << std::endl;
+}
+
+// Function to find the dictionary file belonging to a saved file by walking up to the output root
+std::string findDictionaryFor(const fs::path& file) {
+  for (fs::path dir = fs::absolute(file).parent_path(); ; dir = dir.parent_path()) {
+    fs::path candidate = dir / kDictionaryFilename;
+    if (fs::exists(candidate)) {
+      return candidate.string();
+    }
+    if (dir == dir.root_path()) {
+      throw std::runtime_error("No " + std::string(kDictionaryFilename) + " found above " + file.string());
+    }
+  }
+}
+
+// Dictionaries read by cat and export, by the path of the dictionary file, and the
+// dictionary file found for each directory, so files from several output trees decode
+// with their own dictionary and each tree's dictionary is read once
+struct DictionaryCache {
+  std::unordered_map<std::string, std::string> dictionaries;
+  std::unordered_map<std::string, std::string> paths;
+  
+  const std::string& forFile(const std::string& file) {
+    std::string directory = fs::absolute(file).parent_path().string();
+    auto path = paths.find(directory);
+    if (path == paths.end()) {
+      path = paths.emplace(directory, findDictionaryFor(file)).first;
+    }
+    auto dictionary = dictionaries.find(path->second);
+    if (dictionary == dictionaries.end()) {
+      dictionary = dictionaries.emplace(path->second, readDictionary(path->second)).first;
+    }
+    return dictionary->second;
+  }
+};
+
+// Function to decompress a saved .gz (possibly multi-member) or .zd file to a stream
+void decompressTo(const std::string& data, bool gzip, const std::string& dictionary, std::ostream& out) {
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  if (inflateInit2(&zs, gzip ? 15 + 16 : 15) != Z_OK) {
+    throw std::runtime_error("inflateInit2 failed");
+  }
+  
+  zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+  zs.avail_in = data.size();
+  char outbuffer[65536];
+  int ret;
+  
+  do {
+    zs.next_out = reinterpret_cast<Bytef*>(outbuffer);
+    zs.avail_out = sizeof(outbuffer);
+    ret = inflate(&zs, Z_NO_FLUSH);
+    
+    if (ret == Z_NEED_DICT) {
+      ret = inflateSetDictionary(&zs, reinterpret_cast<const Bytef*>(dictionary.data()), dictionary.size());
+      if (ret != Z_OK) break;
+      continue;
+    }
+    out.write(outbuffer, sizeof(outbuffer) - zs.avail_out);
+    
+    // Parallel-compressed attachments are several gzip members back to back
+    if (ret == Z_STREAM_END && gzip && zs.avail_in > 0) {
+      inflateReset(&zs);
+      ret = Z_OK;
+    }
+  } while (ret == Z_OK);
+  
+  inflateEnd(&zs);
+  if (ret != Z_STREAM_END) {
+    throw std::runtime_error("Corrupt compressed data");
+  }
+}
+
+// Function to write one saved file to a stream, decompressing .gz and .zd files
+void writeSavedFile(const std::string& file, DictionaryCache& dictionaries, std::ostream& out) {
+  std::ifstream in(file, std::ios::binary);
+  if (!in) {
+    throw std::runtime_error("Failed to open " + file);
+  }
+  std::string data(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>{});
+  
+  if (file.ends_with(".zd")) {
+    decompressTo(data, false, dictionaries.forFile(file), out);
+  } else if (file.ends_with(".gz")) {
+    decompressTo(data, true, "", out);
+  } else {
+    out.write(data.data(), data.size());
+  }
+}
+
+// Function implementing "mbox2eml cat": write saved files to stdout, decompressing as needed
+int catFiles(const std::vector<std::string>& files) {
+  DictionaryCache dictionaries;
+  for (const auto& file : files) {
+    try {
+      writeSavedFile(file, dictionaries, std::cout);
+    } catch (const std::exception& e) {
+      std::cerr << "Error reading " << file << ": " << e.what() << std::endl;
+      return 1;
+    }
+  }
+  std::cout.flush();
+  return 0;
+}
+
+// Function to get the email number from a Maildir filename ("<time>.M<number>P<pid>_mbox2eml...")
+long maildirSequence(const std::string& filename) {
+  size_t pos = filename.find(".M");
+  if (pos == std::string::npos) {
+    return -1;
+  }
+  return std::strtol(filename.c_str() + pos + 2, nullptr, 10);
+}
+
+// Function implementing "mbox2eml export": stream every message in cur/ and in Maildir++
+// subfolders to stdout as an mbox, in original order. Stored messages still begin with their "From " line.
+int exportMessages(const std::string& output_dir) {
+  std::vector<std::pair<long, std::string>> messages;
+  try {
+    // The top-level Maildir plus any Maildir++ subfolders (".name/cur")
+    std::vector<fs::path> cur_dirs = {fs::path(output_dir) / "cur"};
+    for (const auto& entry : fs::directory_iterator(output_dir)) {
+      if (entry.is_directory() && entry.path().filename().string().starts_with(".") &&
+          fs::is_directory(entry.path() / "cur")) {
+        cur_dirs.push_back(entry.path() / "cur");
+      }
+    }
+    
+    // Label folders hold hardlinks to messages stored elsewhere; export each file once
+    std::set<std::pair<dev_t, ino_t>> seen_files;
+    for (const auto& cur_dir : cur_dirs) {
+      for (const auto& entry : fs::directory_iterator(cur_dir)) {
+        struct stat st;
+        if (entry.is_regular_file() && stat(entry.path().c_str(), &st) == 0 &&
+            (st.st_nlink == 1 || seen_files.emplace(st.st_dev, st.st_ino).second)) {
+          std::string filename = entry.path().filename().string();
+          messages.emplace_back(maildirSequence(filename), entry.path().string());
+        }
+      }
+    }
+  } catch (const std::exception& e) {
+    std::cerr << "Error reading directory: " << e.what() << std::endl;
+    return 1;
+  }
+  std::sort(messages.begin(), messages.end());
+  
+  // A large stdout buffer keeps the export from being bound by small writes
+  std::vector<char> buffer(1 << 20);
+  std::cout.rdbuf()->pubsetbuf(buffer.data(), buffer.size());
+  
+  DictionaryCache dictionaries;
+  for (const auto& [sequence, file] : messages) {
+    try {
+      writeSavedFile(file, dictionaries, std::cout);
+    } catch (const std::exception& e) {
+      std::cerr << "Error reading " << file << ": " << e.what() << std::endl;
+      return 1;
+    }
+  }
+  std::cout.flush();
+  return 0;
+}
+
+// Directories created during this run. Creation is rare, so it happens under the
+// lock; afterwards a lookup is all a worker pays.
+std::mutex created_directories_mutex;
+std::unordered_set<std::string> created_directories;
+
+// Function to create a directory (with parents) the first time it is needed
+void ensureDirectory(const std::string& path) {
+  if (tar_writer) {
+    return; // tar extraction creates parent directories of members
+  }
+  std::lock_guard<std::mutex> lock(created_directories_mutex);
+  if (created_directories.insert(path).second) {
+    fs::create_directories(path);
+  }
+}
+
+// Function to create a Maildir++ subfolder (".name" with cur/new/tmp) the first time it is needed
+void ensureMaildirFolder(const std::string& folder_path) {
+  std::lock_guard<std::mutex> lock(created_directories_mutex);
+  if (created_directories.insert(folder_path).second) {
+    if (tar_writer) {
+      // Empty cur/new/tmp must still appear in the archive
+      for (const char* dir : {"", "/cur", "/new", "/tmp"}) {
+        tar_writer->addDirectory(folder_path + dir);
+      }
+      tar_writer->addFile(folder_path + "/maildirfolder", "");
+      return;
+    }
+    fs::create_directories(folder_path + "/cur");
+    fs::create_directories(folder_path + "/new");
+    fs::create_directories(folder_path + "/tmp");
+    std::ofstream(folder_path + "/maildirfolder"); // Marks a Maildir++ subfolder
+  }
+}
+
+// Output directories opened during this run; they stay open until exit. They are looked
+// up for every file, by Maildir++ folder or attachment shard rather than by full path.
+std::mutex output_directories_mutex;
+std::vector<std::unique_ptr<OutputDirectory>> output_directories;
+std::unordered_map<std::string, MaildirDirectories> maildir_directories;
+std::unordered_map<std::string, const OutputDirectory*> attachment_directories;
+
+// Function to open an existing output directory; called with output_directories_mutex held
+const OutputDirectory* openOutputDirectory(const std::string& path) {
+  auto dir = std::make_unique<OutputDirectory>();
+  dir->path = path;
+  if (!tar_writer) {
+    dir->fd = ::open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir->fd < 0) {
+      throw std::runtime_error("Failed to open directory " + path + ": " + strerror(errno));
+    }
+  }
+  output_directories.push_back(std::move(dir));
+  return output_directories.back().get();
+}
+
+// Function to get the cur/ and tmp/ directories of a Maildir++ folder ("" for the
+// top-level Maildir), creating the folder the first time it is needed
+MaildirDirectories maildirDirectories(const std::string& output_dir, const std::string& folder) {
+  std::lock_guard<std::mutex> lock(output_directories_mutex);
+  auto found = maildir_directories.find(folder);
+  if (found != maildir_directories.end()) {
+    return found->second;
+  }
+  std::string folder_path = folder.empty() ? output_dir : output_dir + "/" + folder;
+  if (!folder.empty()) {
+    ensureMaildirFolder(folder_path);
+  }
+  MaildirDirectories dirs{openOutputDirectory(folder_path + "/cur"), openOutputDirectory(folder_path + "/tmp")};
+  maildir_directories.emplace(folder, dirs);
+  return dirs;
+}
+
+// Function to get the directory of an attachment shard ("" for attachments/ itself),
+// creating it the first time it is needed
+const OutputDirectory& attachmentDirectory(const std::string& output_dir, const std::string& shard) {
+  std::lock_guard<std::mutex> lock(output_directories_mutex);
+  const OutputDirectory*& dir = attachment_directories[shard];
+  if (dir == nullptr) {
+    std::string path = output_dir + "/attachments/" + shard;
+    path.pop_back();  // Shards end in '/'; the empty shard leaves attachments/
+    ensureDirectory(path);
+    dir = openOutputDirectory(path);
+  }
+  return *dir;
+}
+
+// Function to get the Maildir++ subfolder a message is filed in ("" for the top-level Maildir)
+std::string mailFolder(const Email& email, int email_count) {
+  char name[32];
+  if (options.mail_folders_by_year) {
+    std::tm tm = {};
+    gmtime_r(&email.timestamp, &tm);
+    snprintf(name, sizeof(name), ".%04d", tm.tm_year + 1900);
+    return name;
+  }
+  if (options.mail_folder_size > 0) {
+    snprintf(name, sizeof(name), ".batch-%06d", email_count / options.mail_folder_size);
+    return name;
+  }
+  return "";
+}
+
+// Function to generate Maildir-compatible filename using email timestamp
+std::string generateMaildirFilename(const Email& email, int email_count) {
+  // Use the email's actual timestamp instead of current time. The email number makes
+  // the name unique; it carries no process id so that repeated runs produce the same names
+  char name[64];
+  char* end = formatNumber(name, email.timestamp);
+  end = appendText(end, ".M");
+  end = formatNumber(end, email_count);
+  
+  // Add flags section - :2,S (Seen flag for processed emails)
+  // Use .eml extension for mu compatibility (mu doesn't reliably support .gz files)
+  end = appendText(end, "_mbox2eml:2,S.eml");
+  return std::string(name, end);
+}
+
+// Function to encode attachment content for storage according to its suffix
+std::string encodeAttachment(const Attachment& attachment, const std::string& suffix) {
+  if (suffix == ".zd") {
+    return compressWithDictionary(attachment.content);
+  } else if (suffix == ".gz") {
+    return compressGzipParallel(attachment.content);
+  }
+  return attachment.content;
+}
+
+// Storage encodings recorded in the pack index
+enum PackEncoding : uint32_t {
+  kPackStored = 0,
+  kPackGzip = 1,
+  kPackDictionary = 2
+};
+
+// Fixed-size record of attachments/pack.idx, sorted by (email_id, attachment_index)
+struct PackIndexEntry {
+  uint64_t email_id;
+  uint32_t attachment_index;
+  uint32_t pack_number;
+  uint64_t offset;
+  uint64_t length;
+  uint8_t hash[16];
+  uint32_t encoding;
+  uint32_t reserved;
+};
+static_assert(sizeof(PackIndexEntry) == 56, "PackIndexEntry layout is part of the file format");
+
+const char kPackIndexMagic[8] = {'M', 'B', '2', 'E', 'P', 'I', 'X', '1'};
+
+// An append-only pack file owned by one worker, so appends need no locking
+struct PackWriter {
+  uint32_t pack_number = 0;
+  std::ofstream file;
+  uint64_t size = 0;
+  std::vector<PackIndexEntry> entries;
+};
+
+std::vector<std::unique_ptr<PackWriter>> pack_writers;
+
+// Function to get the path of a pack file
+std::string packPath(const std::string& output_dir, uint32_t pack_number) {
+  std::ostringstream path;
+  path << output_dir << "/attachments/pack-" << std::setfill('0') << std::setw(3) << pack_number << ".pack";
+  return path.str();
+}
+
+// Function to open one pack per worker for appending
+void openPackWriters(const std::string& output_dir, int num_workers) {
+  for (int i = 0; i < num_workers; ++i) {
+    auto writer = std::make_unique<PackWriter>();
+    writer->pack_number = i;
+    std::string path = packPath(output_dir, i);
+    writer->size = fs::exists(path) ? fs::file_size(path) : 0;
+    writer->file.open(path, std::ios::binary | std::ios::app);
+    if (!writer->file) {
+      throw std::runtime_error("Failed to open pack file: " + path);
+    }
+    pack_writers.push_back(std::move(writer));
+  }
+}
+
+// A distinct attachment in the content-addressed store, written by its first occurrence
+struct BlobEntry {
+  std::once_flag written;
+  // Location inside the packs when --pack is used
+  uint32_t pack_number = 0;
+  uint64_t offset = 0;
+  uint64_t length = 0;
+};
+
+std::mutex blob_store_mutex;
+std::unordered_map<std::string, std::shared_ptr<BlobEntry>> blob_store;
+std::mutex manifest_mutex;
+std::ofstream manifest_file;
+std::ostringstream manifest_buffer;  // Used instead of manifest_file with --tar
+std::atomic<long> dedup_occurrences{0};
+std::atomic<long> dedup_unique_blobs{0};
+std::atomic<long long> dedup_bytes_saved{0};
+
+// Function to save an attachment once into the content-addressed store and link this occurrence to it
+void saveDeduplicatedAttachment(const Attachment& attachment, const std::string& output_dir,
+                                const std::string& att_filename) {
+  std::string blob_name = blobName(attachment);
+  std::string blob_path = output_dir + "/attachments/" + blob_name;
+  
+  std::shared_ptr<BlobEntry> entry;
+  {
+    std::lock_guard<std::mutex> lock(blob_store_mutex);
+    auto& slot = blob_store[blob_name];
+    if (!slot) {
+      slot = std::make_shared<BlobEntry>();
+    }
+    entry = slot;
+  }
   
-  int ret;
-  char outbuffer[32768];
-  std::string compressed;
+  // Only the first occurrence compresses and writes; others wait until the blob exists
+  bool first = false;
+  std::call_once(entry->written, [&]() {
+    first = true;
+    dedup_unique_blobs++;
+    if (tar_writer || !fs::exists(blob_path)) {
+      ensureDirectory(fs::path(blob_path).parent_path().string());
+      // Other messages may link to the blob as soon as this returns, so it is not deferred.
+      // An existing blob is trusted by later runs, so it only appears once complete.
+      std::string data = encodeAttachment(attachment, attachmentSuffix(attachment));
+      if (tar_writer) {
+        writeOutputFileNow(blob_path, data);
+      } else {
+        writeOutputFileNow(blob_path + ".tmp", data);
+        syncIfDurable(blob_path + ".tmp");
+        fs::rename(blob_path + ".tmp", blob_path);
+      }
+    }
+  });
+  dedup_occurrences++;
+  if (!first) {
+    dedup_bytes_saved += attachment.content.size();
+  }
   
-  do {
-    zs.next_out = reinterpret_cast<Bytef*>(outbuffer);
-    zs.avail_out = sizeof(outbuffer);
+  std::string link_name = attachmentShard(attachment, options.attachment_shard_levels) +
+                          att_filename + attachmentSuffix(attachment);
+  if (options.dedup_manifest) {
+    std::lock_guard<std::mutex> lock(manifest_mutex);
+    (tar_writer ? static_cast<std::ostream&>(manifest_buffer) : manifest_file)
+        << link_name << '\t' << blob_name << '\n';
+  } else {
+    std::string link_path = output_dir + "/attachments/" + link_name;
+    ensureDirectory(fs::path(link_path).parent_path().string());
+    linkOutputFile(blob_path, link_path);
+  }
+}
+
+// Function to convert a hex content hash back to its 16 raw bytes
+void hashBytes(const std::string& hex, uint8_t* out) {
+  for (size_t i = 0; i < 16; ++i) {
+    out[i] = hex.size() >= 32 ? static_cast<uint8_t>(std::stoi(hex.substr(i * 2, 2), nullptr, 16)) : 0;
+  }
+}
+
+// Function to append an attachment to this worker's pack and record it in the index.
+// With --dedup-attachments only the first occurrence of some content is appended.
+void savePackedAttachment(const Attachment& attachment, int email_count, size_t attachment_index) {
+  PackWriter& pack = *pack_writers[current_worker];
+  std::string suffix = attachmentSuffix(attachment);
+  
+  PackIndexEntry entry{};
+  entry.email_id = email_count;
+  entry.attachment_index = attachment_index;
+  entry.encoding = suffix == ".gz" ? kPackGzip : suffix == ".zd" ? kPackDictionary : kPackStored;
+  hashBytes(attachment.content_hash, entry.hash);
+  
+  auto append = [&](uint32_t& pack_number, uint64_t& offset, uint64_t& length) {
+    std::string data = encodeAttachment(attachment, suffix);
+    write_limiter.acquire(data.size());
+    pack.file.write(data.data(), data.size());
+    if (!pack.file) {
+      throw std::runtime_error("Failed to append to pack " + std::to_string(pack.pack_number));
+    }
+    pack_number = pack.pack_number;
+    offset = pack.size;
+    length = data.size();
+    pack.size += data.size();
+  };
+  
+  if (options.dedup_attachments) {
+    std::shared_ptr<BlobEntry> blob;
+    {
+      std::lock_guard<std::mutex> lock(blob_store_mutex);
+      auto& slot = blob_store[blobName(attachment)];
+      if (!slot) {
+        slot = std::make_shared<BlobEntry>();
+      }
+      blob = slot;
+    }
+    bool first = false;
+    std::call_once(blob->written, [&]() {
+      first = true;
+      dedup_unique_blobs++;
+      append(blob->pack_number, blob->offset, blob->length);
+    });
+    dedup_occurrences++;
+    if (!first) {
+      dedup_bytes_saved += attachment.content.size();
+    }
+    entry.pack_number = blob->pack_number;
+    entry.offset = blob->offset;
+    entry.length = blob->length;
+  } else {
+    append(entry.pack_number, entry.offset, entry.length);
+  }
+  
+  pack.entries.push_back(entry);
+}
+
+// Function to read the pack index of an output directory (empty if there is none)
+std::vector<PackIndexEntry> readPackIndex(const std::string& output_dir) {
+  std::vector<PackIndexEntry> entries;
+  std::ifstream in(output_dir + "/attachments/pack.idx", std::ios::binary);
+  if (!in) {
+    return entries;
+  }
+  char magic[8];
+  uint64_t count = 0;
+  in.read(magic, sizeof(magic));
+  in.read(reinterpret_cast<char*>(&count), sizeof(count));
+  if (!in || memcmp(magic, kPackIndexMagic, sizeof(magic)) != 0) {
+    throw std::runtime_error("Not a pack index: " + output_dir + "/attachments/pack.idx");
+  }
+  entries.resize(count);
+  in.read(reinterpret_cast<char*>(entries.data()), count * sizeof(PackIndexEntry));
+  if (!in) {
+    throw std::runtime_error("Truncated pack index: " + output_dir + "/attachments/pack.idx");
+  }
+  return entries;
+}
+
+// Function to move the entries of a completed chunk from memory to attachments/pack.idx.log,
+// so they survive an interrupted run and are merged by a resumed one
+void appendPackIndexLog(const std::string& output_dir) {
+  std::ofstream log(output_dir + "/attachments/pack.idx.log", std::ios::binary | std::ios::app);
+  for (auto& writer : pack_writers) {
+    writer->file.flush();
+    // The packed data must be on disk before the index entries pointing into it
+    syncIfDurable(packPath(output_dir, writer->pack_number));
+    log.write(reinterpret_cast<const char*>(writer->entries.data()), writer->entries.size() * sizeof(PackIndexEntry));
+    writer->entries.clear();
+  }
+  log.close();
+  if (!log) {
+    throw std::runtime_error("Failed to append to " + output_dir + "/attachments/pack.idx.log");
+  }
+  syncIfDurable(output_dir + "/attachments/pack.idx.log");
+}
+
+// Function to merge the pack index log and this run's pack entries into the sorted pack index
+void writePackIndex(const std::string& output_dir) {
+  std::vector<PackIndexEntry> entries = readPackIndex(output_dir);
+  std::string log_path = output_dir + "/attachments/pack.idx.log";
+  std::ifstream log(log_path, std::ios::binary);
+  PackIndexEntry logged;
+  while (log.read(reinterpret_cast<char*>(&logged), sizeof(logged))) {
+    entries.push_back(logged);
+  }
+  for (auto& writer : pack_writers) {
+    writer->file.flush();
+    entries.insert(entries.end(), writer->entries.begin(), writer->entries.end());
+  }
+  std::stable_sort(entries.begin(), entries.end(), [](const PackIndexEntry& a, const PackIndexEntry& b) {
+    return std::tie(a.email_id, a.attachment_index) < std::tie(b.email_id, b.attachment_index);
+  });
+  // A resumed run may pack an attachment again; keep the newest (last) entry for each key
+  std::vector<PackIndexEntry> unique_entries;
+  for (const auto& entry : entries) {
+    if (!unique_entries.empty() && unique_entries.back().email_id == entry.email_id &&
+        unique_entries.back().attachment_index == entry.attachment_index) {
+      unique_entries.back() = entry;
+    } else {
+      unique_entries.push_back(entry);
+    }
+  }
+  entries = std::move(unique_entries);
+  
+  std::string index_path = output_dir + "/attachments/pack.idx";
+  std::string data(kPackIndexMagic, sizeof(kPackIndexMagic));
+  uint64_t count = entries.size();
+  data.append(reinterpret_cast<const char*>(&count), sizeof(count));
+  data.append(reinterpret_cast<const char*>(entries.data()), entries.size() * sizeof(PackIndexEntry));
+  writeOutputFile(index_path + ".tmp", data);
+  syncIfDurable(index_path + ".tmp");
+  fs::rename(index_path + ".tmp", index_path);
+  fs::remove(log_path);
+}
+
+// Function implementing "mbox2eml extract": write one packed attachment to stdout, found
+// either by email number and attachment index (binary search) or by content hash (scan)
+int extractPackedAttachment(const std::string& output_dir, const std::vector<std::string>& keys) {
+  try {
+    std::vector<PackIndexEntry> entries = readPackIndex(output_dir);
+    const PackIndexEntry* found = nullptr;
     
-    ret = deflate(&zs, Z_FINISH);
+    if (keys.size() == 2) {
+      PackIndexEntry key{};
+      key.email_id = std::stoull(keys[0]);
+      key.attachment_index = std::stoul(keys[1]);
+      auto it = std::lower_bound(entries.begin(), entries.end(), key,
+                                 [](const PackIndexEntry& a, const PackIndexEntry& b) {
+        return std::tie(a.email_id, a.attachment_index) < std::tie(b.email_id, b.attachment_index);
+      });
+      if (it != entries.end() && it->email_id == key.email_id && it->attachment_index == key.attachment_index) {
+        found = &*it;
+      }
+    } else {
+      uint8_t hash[16];
+      hashBytes(keys[0], hash);
+      for (const auto& entry : entries) {
+        if (memcmp(entry.hash, hash, sizeof(hash)) == 0) {
+          found = &entry;
+          break;
+        }
+      }
+    }
+    if (!found) {
+      std::cerr << "No packed attachment matches" << std::endl;
+      return 1;
+    }
     
-    if (compressed.size() < zs.total_out) {
-      compressed.append(outbuffer, zs.total_out - compressed.size());
+    std::ifstream pack(packPath(output_dir, found->pack_number), std::ios::binary);
+    std::string data(found->length, '\0');
+    pack.seekg(found->offset);
+    pack.read(data.data(), data.size());
+    if (!pack) {
+      throw std::runtime_error("Failed to read pack " + std::to_string(found->pack_number));
     }
-  } while (ret == Z_OK);
+    
+    if (found->encoding == kPackStored) {
+      std::cout.write(data.data(), data.size());
+    } else {
+      std::string dictionary;
+      if (found->encoding == kPackDictionary) {
+        dictionary = readDictionary(findDictionaryFor(output_dir + "/attachments/pack.idx"));
+      }
+      decompressTo(data, found->encoding == kPackGzip, dictionary, std::cout);
+    }
+    std::cout.flush();
+  } catch (const std::exception& e) {
+    std::cerr << "Error extracting attachment: " << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
+
+// Function to save attachments separately, returning false if any of them failed
+bool saveAttachments(const Email& email, const std::string& output_dir, int email_count) {
+  bool saved_all = true;
+  for (size_t i = 0; i < email.attachments.size(); ++i) {
+    const auto& attachment = email.attachments[i];
+    
+    std::string att_filename = attachmentFilename(email_count, i, attachment);
+    
+    try {
+      // Store formats that are already compressed or will not shrink as-is
+      CompressionRule rule = attachment.compression_rule;
+      compression_rule_counts[rule]++;
+      
+      if (options.pack_attachments) {
+        savePackedAttachment(attachment, email_count, i);
+      } else if (options.dedup_attachments) {
+        saveDeduplicatedAttachment(attachment, output_dir, att_filename);
+      } else {
+        std::string suffix = attachmentSuffix(attachment);
+        const OutputDirectory& dir =
+            attachmentDirectory(output_dir, attachmentShard(attachment, options.attachment_shard_levels));
+        writeOutputFileAt(dir, att_filename + suffix, encodeAttachment(attachment, suffix));
+      }
+      
+    } catch (const std::exception& e) {
+      std::cerr << "Error saving attachment " << i << " for email " << email_count 
+                << ": " << e.what() << std::endl;
+      saved_all = false;
+    }
+  }
+  return saved_all;
+}
+
+std::atomic<long> label_links_created{0};
+
+// Function to hardlink a saved message into the Maildir++ folder of each of the given Gmail labels
+void linkIntoLabelFolders(const std::vector<std::string>& labels, const std::string& output_dir,
+                          const std::string& saved_path) {
+  std::string saved_name = fs::path(saved_path).filename().string();
+  for (const auto& label : labels) {
+    if (!options.only_labels.empty() && !options.only_labels.count(label)) {
+      continue;
+    }
+    std::string folder_path = output_dir + "/" + labelFolder(label);
+    try {
+      ensureMaildirFolder(folder_path);
+      linkOutputFile(saved_path, folder_path + "/cur/" + saved_name);
+      label_links_created++;
+    } catch (const std::exception& e) {
+      std::cerr << "Error linking message into label folder " << label << ": " << e.what() << std::endl;
+    }
+  }
+}
+
+// Function to get the file name of a saved message, including the suffix of its encoding
+std::string messageFilename(const Email& email, int email_count) {
+  std::string name = generateMaildirFilename(email, email_count);
+  if (options.use_dictionary && email.content.size() <= kDictMaxFileSize) {
+    name += ".zd";
+  } else if (options.compress_bodies) {
+    name += ".gz";
+  }
+  return name;
+}
+
+// Function to get the path of a saved message relative to the output directory,
+// including the suffix of its encoding
+std::string messagePath(const Email& email, int email_count) {
+  std::string folder = mailFolder(email, email_count);
+  return folder + (folder.empty() ? "" : "/") + "cur/" + messageFilename(email, email_count);
+}
+
+// Function to save an email to an .eml file in Maildir cur directory. Bodies stay
+// uncompressed for mu unless --dict (small ones as .eml.zd) or --compress-bodies
+// (.eml.gz) asks for compact archival output. Returns false if anything failed to save.
+bool saveEmail(const Email& email, const std::string& output_dir, int email_count) {
+  std::string filename = messageFilename(email, email_count);
   
-  deflateEnd(&zs);
+  try {
+    MaildirDirectories dirs = maildirDirectories(output_dir, mailFolder(email, email_count));
+    
+    // Save the stripped email content
+    if (filename.ends_with(".zd")) {
+      deliverMessageFile(dirs, filename, compressWithDictionary(email.content));
+    } else if (filename.ends_with(".gz")) {
+      deliverMessageFile(dirs, filename, compressGzipParallel(email.content));
+    } else {
+      deliverMessageFile(dirs, filename, email.content);
+    }
+    
+    // The message is written once; each label folder gets a hardlink to it
+    if (options.label_folders) {
+      linkIntoLabelFolders(email.labels, output_dir, dirs.cur->path + "/" + filename);
+    }
+    
+    // Save attachments separately if any exist
+    if (!email.attachments.empty()) {
+      return saveAttachments(email, output_dir, email_count);
+    }
+    return true;
+    
+  } catch (const std::exception& e) {
+    std::cerr << "Error saving email " << email_count << ": " << e.what() << std::endl;
+    return false;
+  }
+}
+
+const std::string kMetadataIndexFilename = "mbox2eml.index";
+const char kMetadataIndexMagic[8] = {'M', 'B', 'X', 'I', 'D', 'X', '0', '1'};
+
+// Header of mbox2eml.index. It is followed by count MetadataRecords sorted by email
+// number, then by the string pool the records point into.
+struct MetadataIndexHeader {
+  char magic[8];
+  uint64_t count;
+  uint64_t strings_size;
+};
+
+// A string in the pool of mbox2eml.index
+struct MetadataString {
+  uint64_t offset;
+  uint64_t length;
+};
+
+// Fixed-size record of mbox2eml.index
+struct MetadataRecord {
+  uint64_t email_number;
+  int64_t timestamp;
+  uint64_t size;               // Raw message size in the chunk file
+  uint64_t source_offset;      // Byte offset of the message in the chunk file
+  uint64_t attachment_count;
+  MetadataString path;         // Saved message, relative to the output directory
+  MetadataString message_id;
+  MetadataString from;
+  MetadataString to;
+  MetadataString subject;
+  MetadataString chunk;        // Chunk file name
+  MetadataString attachment_hashes;  // attachment_count 32-character content hashes, concatenated
+};
+
+// Metadata of one saved message, as collected by the workers
+struct MessageMetadata {
+  uint64_t email_number = 0;
+  int64_t timestamp = 0;
+  uint64_t size = 0;
+  uint64_t source_offset = 0;
+  uint64_t attachment_count = 0;
+  std::string path, message_id, from, to, subject, chunk, attachment_hashes;
+};
+
+// Per-worker buffers of collected metadata, moved to disk when a chunk completes
+std::vector<std::vector<MessageMetadata>> metadata_buffers;
+
+// Function to trim surrounding whitespace from a header value
+std::string trimHeaderValue(const std::string& value) {
+  size_t start = value.find_first_not_of(" \t");
+  if (start == std::string::npos) return "";
+  return value.substr(start, value.find_last_not_of(" \t") - start + 1);
+}
+
+// Function to collect the index metadata of a saved message
+MessageMetadata describeMessage(const Email& email, const std::string& chunk_name, int email_count) {
+  MessageMetadata metadata;
+  metadata.email_number = email_count;
+  metadata.timestamp = email.timestamp;
+  metadata.size = email.source_size;
+  metadata.source_offset = email.source_offset;
+  metadata.attachment_count = email.attachments.size();
+  metadata.path = messagePath(email, email_count);
+  metadata.message_id = trimHeaderValue(extractHeader(email.content, "Message-ID"));
+  metadata.from = trimHeaderValue(extractHeader(email.content, "From"));
+  metadata.to = trimHeaderValue(extractHeader(email.content, "To"));
+  metadata.subject = trimHeaderValue(extractHeader(email.content, "Subject"));
+  metadata.chunk = chunk_name;
+  for (const auto& attachment : email.attachments) {
+    metadata.attachment_hashes += attachment.content_hash;
+  }
+  return metadata;
+}
+
+// Function to encode metadata (sorted by email number) in the mbox2eml.index format
+std::string encodeMetadataIndex(const std::vector<MessageMetadata>& entries) {
+  std::string strings;
+  auto add_string = [&](const std::string& value) {
+    MetadataString ref{strings.size(), value.size()};
+    strings += value;
+    return ref;
+  };
+  std::vector<MetadataRecord> records;
+  records.reserve(entries.size());
+  for (const auto& entry : entries) {
+    MetadataRecord record{};
+    record.email_number = entry.email_number;
+    record.timestamp = entry.timestamp;
+    record.size = entry.size;
+    record.source_offset = entry.source_offset;
+    record.attachment_count = entry.attachment_count;
+    record.path = add_string(entry.path);
+    record.message_id = add_string(entry.message_id);
+    record.from = add_string(entry.from);
+    record.to = add_string(entry.to);
+    record.subject = add_string(entry.subject);
+    record.chunk = add_string(entry.chunk);
+    record.attachment_hashes = add_string(entry.attachment_hashes);
+    records.push_back(record);
+  }
   
-  if (ret != Z_STREAM_END) {
-    throw std::runtime_error("Error during compression");
+  MetadataIndexHeader header;
+  memcpy(header.magic, kMetadataIndexMagic, sizeof(kMetadataIndexMagic));
+  header.count = records.size();
+  header.strings_size = strings.size();
+  std::string data(reinterpret_cast<const char*>(&header), sizeof(header));
+  data.append(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(MetadataRecord));
+  data += strings;
+  return data;
+}
+
+// Function to decode one mbox2eml.index image at the start of data, appending its
+// entries; returns the number of bytes it occupies
+size_t decodeMetadataIndex(std::string_view data, std::vector<MessageMetadata>& entries) {
+  MetadataIndexHeader header;
+  if (data.size() < sizeof(header)) {
+    throw std::runtime_error("truncated metadata index");
+  }
+  memcpy(&header, data.data(), sizeof(header));
+  size_t records_size = header.count * sizeof(MetadataRecord);
+  if (memcmp(header.magic, kMetadataIndexMagic, sizeof(kMetadataIndexMagic)) != 0 ||
+      data.size() - sizeof(header) < records_size + header.strings_size) {
+    throw std::runtime_error("invalid metadata index");
+  }
+  std::string_view strings = data.substr(sizeof(header) + records_size, header.strings_size);
+  auto get_string = [&](const MetadataString& ref) {
+    if (ref.offset > strings.size() || ref.length > strings.size() - ref.offset) {
+      throw std::runtime_error("invalid string in metadata index");
+    }
+    return std::string(strings.substr(ref.offset, ref.length));
+  };
+  for (uint64_t i = 0; i < header.count; ++i) {
+    MetadataRecord record;
+    memcpy(&record, data.data() + sizeof(header) + i * sizeof(MetadataRecord), sizeof(record));
+    MessageMetadata entry;
+    entry.email_number = record.email_number;
+    entry.timestamp = record.timestamp;
+    entry.size = record.size;
+    entry.source_offset = record.source_offset;
+    entry.attachment_count = record.attachment_count;
+    entry.path = get_string(record.path);
+    entry.message_id = get_string(record.message_id);
+    entry.from = get_string(record.from);
+    entry.to = get_string(record.to);
+    entry.subject = get_string(record.subject);
+    entry.chunk = get_string(record.chunk);
+    entry.attachment_hashes = get_string(record.attachment_hashes);
+    entries.push_back(std::move(entry));
+  }
+  return sizeof(header) + records_size + header.strings_size;
+}
+
+// Function to append the workers' metadata of a completed chunk to mbox2eml.index.log,
+// so that an interrupted run keeps it
+void appendMetadataLog(const std::string& output_dir) {
+  std::vector<MessageMetadata> entries;
+  for (auto& buffer : metadata_buffers) {
+    std::move(buffer.begin(), buffer.end(), std::back_inserter(entries));
+    buffer.clear();
+  }
+  std::ofstream log(output_dir + "/" + kMetadataIndexFilename + ".log", std::ios::binary | std::ios::app);
+  log << encodeMetadataIndex(entries);
+  log.close();
+  if (!log) {
+    throw std::runtime_error("Failed to append to " + output_dir + "/" + kMetadataIndexFilename + ".log");
+  }
+  syncIfDurable(output_dir + "/" + kMetadataIndexFilename + ".log");
+}
+
+// Function to get the length of the valid UTF-8 sequence starting at value[i], 0 if the
+// bytes there are not one (stray continuation bytes, overlong forms, surrogates)
+size_t utf8SequenceLength(const std::string& value, size_t i) {
+  unsigned char lead = static_cast<unsigned char>(value[i]);
+  size_t length;
+  uint32_t code_point;
+  if (lead >= 0xc2 && lead <= 0xdf) {
+    length = 2;
+    code_point = lead & 0x1f;
+  } else if (lead >= 0xe0 && lead <= 0xef) {
+    length = 3;
+    code_point = lead & 0x0f;
+  } else if (lead >= 0xf0 && lead <= 0xf4) {
+    length = 4;
+    code_point = lead & 0x07;
+  } else {
+    return 0;
+  }
+  if (i + length > value.size()) {
+    return 0;
+  }
+  for (size_t k = 1; k < length; ++k) {
+    unsigned char next = static_cast<unsigned char>(value[i + k]);
+    if ((next & 0xc0) != 0x80) {
+      return 0;
+    }
+    code_point = code_point << 6 | (next & 0x3f);
+  }
+  bool overlong = (length == 3 && code_point < 0x800) || (length == 4 && code_point < 0x10000);
+  if (overlong || (code_point >= 0xd800 && code_point <= 0xdfff) || code_point > 0x10ffff) {
+    return 0;
+  }
+  return length;
+}
+
+// Function to quote a string for JSON. Valid UTF-8 is passed through; control
+// characters and bytes that are not part of valid UTF-8 are escaped.
+std::string jsonString(const std::string& value) {
+  std::string quoted = "\"";
+  for (size_t i = 0; i < value.size(); ++i) {
+    char c = value[i];
+    unsigned char byte = static_cast<unsigned char>(c);
+    if (c == '"' || c == '\\') {
+      quoted += '\\';
+      quoted += c;
+    } else if (byte < 0x20) {
+      char escape[8];
+      snprintf(escape, sizeof(escape), "\\u%04x", byte);
+      quoted += escape;
+    } else if (byte < 0x80) {
+      quoted += c;
+    } else if (size_t length = utf8SequenceLength(value, i)) {
+      quoted.append(value, i, length);
+      i += length - 1;
+    } else {
+      // Raw 8-bit headers (Latin-1, Shift-JIS) are not UTF-8; each stray byte is read
+      // as Latin-1 so the line stays valid JSON
+      char escape[8];
+      snprintf(escape, sizeof(escape), "\\u%04x", byte);
+      quoted += escape;
+    }
+  }
+  return quoted + "\"";
+}
+
+// Function to format one metadata entry as a JSON line
+std::string metadataJsonLine(const MessageMetadata& entry) {
+  std::ostringstream line;
+  line << "{\"email_number\":" << entry.email_number << ",\"path\":" << jsonString(entry.path)
+       << ",\"timestamp\":" << entry.timestamp << ",\"message_id\":" << jsonString(entry.message_id)
+       << ",\"from\":" << jsonString(entry.from) << ",\"to\":" << jsonString(entry.to)
+       << ",\"subject\":" << jsonString(entry.subject) << ",\"size\":" << entry.size << ",\"attachments\":[";
+  for (size_t i = 0; i < entry.attachment_hashes.size(); i += 32) {
+    line << (i == 0 ? "" : ",") << jsonString(entry.attachment_hashes.substr(i, 32));
+  }
+  line << "],\"chunk\":" << jsonString(entry.chunk) << ",\"offset\":" << entry.source_offset << "}\n";
+  return line.str();
+}
+
+// Function to merge the existing index, the metadata log and the workers' buffers into
+// a new mbox2eml.index (and mbox2eml.index.jsonl)
+void writeMetadataIndex(const std::string& output_dir) {
+  std::string index_path = output_dir + "/" + kMetadataIndexFilename;
+  std::string log_path = index_path + ".log";
+  std::vector<MessageMetadata> entries;
+  if (!tar_writer) {
+    for (const std::string& path : {index_path, log_path}) {
+      std::ifstream file(path, std::ios::binary);
+      std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+      for (size_t pos = 0; pos < data.size(); ) {
+        pos += decodeMetadataIndex(std::string_view(data).substr(pos), entries);
+      }
+    }
+  }
+  for (auto& buffer : metadata_buffers) {
+    std::move(buffer.begin(), buffer.end(), std::back_inserter(entries));
+    buffer.clear();
+  }
+  
+  // Later entries come from later runs; keep the last one for each email number
+  std::stable_sort(entries.begin(), entries.end(), [](const MessageMetadata& a, const MessageMetadata& b) {
+    return a.email_number < b.email_number;
+  });
+  std::vector<MessageMetadata> unique_entries;
+  for (auto& entry : entries) {
+    if (!unique_entries.empty() && unique_entries.back().email_number == entry.email_number) {
+      unique_entries.back() = std::move(entry);
+    } else {
+      unique_entries.push_back(std::move(entry));
+    }
+  }
+  
+  std::string jsonl;
+  if (options.metadata_jsonl) {
+    for (const auto& entry : unique_entries) {
+      jsonl += metadataJsonLine(entry);
+    }
+  }
+  if (tar_writer) {
+    writeOutputFile(index_path, encodeMetadataIndex(unique_entries));
+    if (options.metadata_jsonl) {
+      writeOutputFile(index_path + ".jsonl", jsonl);
+    }
+    return;
+  }
+  writeOutputFile(index_path + ".tmp", encodeMetadataIndex(unique_entries));
+  syncIfDurable(index_path + ".tmp");
+  fs::rename(index_path + ".tmp", index_path);
+  if (options.metadata_jsonl) {
+    writeOutputFile(index_path + ".jsonl.tmp", jsonl);
+    syncIfDurable(index_path + ".jsonl.tmp");
+    fs::rename(index_path + ".jsonl.tmp", index_path + ".jsonl");
+  }
+  fs::remove(log_path);
+}
+
+// Function to carry out file writes one by one, flushing each file as asked, and storing
+// each failure in errors
+void writeFilesPosix(const std::vector<const FileOp*>& files, std::vector<std::string>& errors, FileFlush flush) {
+  // Files to sync or evict stay open until writeback has been started for all of them,
+  // so the batch is written back in parallel
+  bool wait = flush == kFlushDataSync || options.drop_output_cache;
+  std::vector<std::pair<int, size_t>> open_files;
+  for (size_t i = 0; i < files.size(); i++) {
+    try {
+      int fd = createFileAt(files[i]->dir, files[i]->path, files[i]->data, flush == kFlushFsync);
+      if (!wait) {
+        closeFileAt(fd, files[i]->dir, files[i]->path);
+        continue;
+      }
+      startWriteback(fd);
+      open_files.push_back({fd, i});
+    } catch (const std::exception& e) {
+      errors[i] = e.what();
+    }
+  }
+  for (auto [fd, i] : open_files) {
+    try {
+      finishFileAt(fd, files[i]->dir, files[i]->path, flush);
+    } catch (const std::exception& e) {
+      errors[i] = e.what();
+    }
+  }
+}
+
+#ifdef HAVE_IO_URING
+// Writes many files with few system calls through an io_uring. Each file is an
+// openat -> write [-> fsync] [-> sync_file_range] [-> fadvise] -> close chain on a direct
+// descriptor from a registered file table, so the open file never gets a normal
+// descriptor, and up to kSlots files go to the kernel in one io_uring_enter. Needs Linux
+// 5.19 or later for the sparse file table; init() fails on older kernels or when
+// io_uring is disabled, and callers then use the posix path.
+class UringWriter {
+ public:
+  static constexpr unsigned kEntries = 512;
+  static constexpr unsigned kSlots = 64;           // Files in flight per submission
+  static constexpr size_t kMaxWrite = 1u << 30;    // Larger files take the posix path
+  
+  UringWriter() = default;
+  UringWriter(const UringWriter&) = delete;
+  UringWriter& operator=(const UringWriter&) = delete;
+  
+  ~UringWriter() {
+    if (sqes_ != MAP_FAILED) {
+      munmap(sqes_, sqes_size_);
+    }
+    if (cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_) {
+      munmap(cq_ring_, cq_ring_size_);
+    }
+    if (sq_ring_ != MAP_FAILED) {
+      munmap(sq_ring_, sq_ring_size_);
+    }
+    if (ring_fd_ >= 0) {
+      close(ring_fd_);
+    }
+  }
+  
+  // Function to set up the ring and its file table; false when io_uring is unavailable
+  bool init() {
+    io_uring_params params{};
+    ring_fd_ = static_cast<int>(syscall(__NR_io_uring_setup, kEntries, &params));
+    if (ring_fd_ < 0) {
+      return false;
+    }
+    sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+      sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+    }
+    sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_,
+                    IORING_OFF_SQ_RING);
+    if (sq_ring_ == MAP_FAILED) {
+      return false;
+    }
+    cq_ring_ = single_mmap ? sq_ring_
+                           : mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                  ring_fd_, IORING_OFF_CQ_RING);
+    if (cq_ring_ == MAP_FAILED) {
+      return false;
+    }
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    sqes_ = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+    if (sqes_ == MAP_FAILED) {
+      return false;
+    }
+    char* sq = static_cast<char*>(sq_ring_);
+    char* cq = static_cast<char*>(cq_ring_);
+    sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sq_mask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    
+    io_uring_rsrc_register files{};
+    files.nr = kSlots;
+    files.flags = IORING_RSRC_REGISTER_SPARSE;
+    return syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_FILES2, &files, sizeof(files)) == 0;
+  }
+  
+  // Function to write whole files, flushing them as asked, and storing each failure in errors
+  void writeFiles(const std::vector<const FileOp*>& files, std::vector<std::string>& errors, FileFlush flush) {
+    std::vector<size_t> round;
+    for (size_t i = 0; i < files.size(); i++) {
+      if (files[i]->data.size() > kMaxWrite) {
+        try {
+          writeFileAt(files[i]->dir, files[i]->path, files[i]->data, flush);
+        } catch (const std::exception& e) {
+          errors[i] = e.what();
+        }
+        continue;
+      }
+      round.push_back(i);
+      if (round.size() == kSlots) {
+        writeRound(files, round, errors, flush);
+        round.clear();
+      }
+    }
+    if (!round.empty()) {
+      writeRound(files, round, errors, flush);
+    }
+  }
+  
+ private:
+  enum Step { kOpen, kWrite, kSync, kWriteback, kDrop, kClose, kSteps };
+  
+  io_uring_sqe* nextSqe(unsigned& tail) {
+    unsigned index = tail & sq_mask_;
+    sq_array_[index] = index;
+    tail++;
+    io_uring_sqe* sqe = static_cast<io_uring_sqe*>(sqes_) + index;
+    std::memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+  }
+  
+  void writeRound(const std::vector<const FileOp*>& files, const std::vector<size_t>& round,
+                  std::vector<std::string>& errors, FileFlush flush) {
+    // Without a sync, --drop-output-cache still waits for the writeback before evicting
+    bool wait = flush == kFlushNone && options.drop_output_cache;
+    size_t bytes = 0;
+    for (size_t index : round) {
+      bytes += files[index]->data.size();
+    }
+    file_limiter.acquire(round.size());
+    write_limiter.acquire(bytes);
+    unsigned tail = *sq_tail_;
+    for (unsigned slot = 0; slot < round.size(); slot++) {
+      const FileOp& file = *files[round[slot]];
+      // A failed open cancels the rest of the chain; the close runs whatever the write did
+      io_uring_sqe* open = nextSqe(tail);
+      open->opcode = IORING_OP_OPENAT;
+      open->fd = file.dir != nullptr ? file.dir->fd : AT_FDCWD;
+      open->addr = reinterpret_cast<uint64_t>(file.path.c_str());
+      open->len = 0644;
+      open->open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+      open->file_index = slot + 1;
+      open->flags = IOSQE_IO_LINK;
+      open->user_data = slot * kSteps + kOpen;
+      io_uring_sqe* write = nextSqe(tail);
+      write->opcode = IORING_OP_WRITE;
+      write->fd = slot;
+      write->addr = reinterpret_cast<uint64_t>(file.data.data());
+      write->len = file.data.size();
+      write->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+      write->user_data = slot * kSteps + kWrite;
+      if (flush != kFlushNone) {
+        // The chains of a round run in parallel, so all files are written back at once
+        io_uring_sqe* fsync = nextSqe(tail);
+        fsync->opcode = IORING_OP_FSYNC;
+        fsync->fsync_flags = flush == kFlushDataSync ? IORING_FSYNC_DATASYNC : 0;
+        fsync->fd = slot;
+        fsync->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+        fsync->user_data = slot * kSteps + kSync;
+      }
+      if (wait) {
+        io_uring_sqe* writeback = nextSqe(tail);
+        writeback->opcode = IORING_OP_SYNC_FILE_RANGE;
+        writeback->fd = slot;
+        writeback->sync_range_flags = SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER;
+        writeback->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+        writeback->user_data = slot * kSteps + kWriteback;
+      }
+      if (options.drop_output_cache) {
+        io_uring_sqe* drop = nextSqe(tail);
+        drop->opcode = IORING_OP_FADVISE;
+        drop->fd = slot;
+        drop->fadvise_advice = POSIX_FADV_DONTNEED;
+        drop->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+        drop->user_data = slot * kSteps + kDrop;
+      }
+      io_uring_sqe* close = nextSqe(tail);
+      close->opcode = IORING_OP_CLOSE;
+      close->file_index = slot + 1;
+      close->user_data = slot * kSteps + kClose;
+    }
+    unsigned pending = tail - *sq_tail_;
+    __atomic_store_n(sq_tail_, tail, __ATOMIC_RELEASE);
+    
+    std::vector<int> results(round.size() * kSteps, 0);
+    unsigned to_submit = pending;
+    while (pending > 0) {
+      int ret = static_cast<int>(syscall(__NR_io_uring_enter, ring_fd_, to_submit, pending, IORING_ENTER_GETEVENTS,
+                                         nullptr, 0));
+      if (ret < 0 && errno != EINTR) {
+        throw std::runtime_error(std::string("io_uring_enter failed: ") + strerror(errno));
+      }
+      if (ret > 0) {
+        to_submit -= std::min<unsigned>(to_submit, ret);
+      }
+      unsigned head = *cq_head_;
+      unsigned cq_tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+      for (; head != cq_tail; head++) {
+        const io_uring_cqe& cqe = cqes_[head & cq_mask_];
+        results[cqe.user_data] = cqe.res;
+        pending--;
+      }
+      __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+    }
+    
+    for (unsigned slot = 0; slot < round.size(); slot++) {
+      const FileOp& file = *files[round[slot]];
+      if (options.drop_output_cache && results[slot * kSteps + kDrop] == 0) {
+        output_files_dropped++;
+      }
+      int opened = results[slot * kSteps + kOpen];
+      int written = results[slot * kSteps + kWrite];
+      if (opened < 0) {
+        errors[round[slot]] = "Failed to create output file: " + file.fullPath() + ": " + strerror(-opened);
+      } else if (written < 0 || results[slot * kSteps + kClose] < 0) {
+        errors[round[slot]] = "Failed to write data to: " + file.fullPath();
+      } else if (results[slot * kSteps + kSync] < 0) {
+        errors[round[slot]] = "Failed to sync " + file.fullPath() + ": " + strerror(-results[slot * kSteps + kSync]);
+      } else if (static_cast<size_t>(written) != file.data.size()) {
+        // Short write (e.g. interrupted by a signal): write the file again the plain way
+        try {
+          writeFileAt(file.dir, file.path, file.data, flush);
+        } catch (const std::exception& e) {
+          errors[round[slot]] = e.what();
+        }
+      }
+    }
   }
   
-  return compressed;
-}
+  int ring_fd_ = -1;
+  void* sq_ring_ = MAP_FAILED;
+  void* cq_ring_ = MAP_FAILED;
+  void* sqes_ = MAP_FAILED;
+  size_t sq_ring_size_ = 0;
+  size_t cq_ring_size_ = 0;
+  size_t sqes_size_ = 0;
+  unsigned* sq_tail_ = nullptr;
+  unsigned sq_mask_ = 0;
+  unsigned* sq_array_ = nullptr;
+  unsigned* cq_head_ = nullptr;
+  unsigned* cq_tail_ = nullptr;
+  unsigned cq_mask_ = 0;
+  io_uring_cqe* cqes_ = nullptr;
+};
 
-// Function to generate Maildir-compatible filename using email timestamp
-std::string generateMaildirFilename(const Email& email, int email_count) {
-  // Use the email's actual timestamp instead of current time
-  std::ostringstream unique_id;
-  unique_id << email.timestamp << ".M" << email_count << "P" << getpid() << "_mbox2eml";
-  
-  // Add flags section - :2,S (Seen flag for processed emails)
-  // Use .eml extension for mu compatibility (mu doesn't reliably support .gz files)
-  std::string filename = unique_id.str() + ":2,S.eml";
-  
-  return filename;
+// One ring per I/O thread, set up on its first batch
+thread_local std::unique_ptr<UringWriter> uring_writer;
+#endif
+
+// Set in main when --io-backend selects io_uring and the kernel supports it
+bool use_io_uring = false;
+
+// Function to write whole files on the selected backend, flushing them as asked, and
+// storing each failure in errors
+void writeFiles(const std::vector<const FileOp*>& files, std::vector<std::string>& errors, FileFlush flush) {
+#ifdef HAVE_IO_URING
+  if (use_io_uring) {
+    if (!uring_writer) {
+      uring_writer = std::make_unique<UringWriter>();
+      if (!uring_writer->init()) {
+        throw std::runtime_error("Failed to set up io_uring");
+      }
+    }
+    uring_writer->writeFiles(files, errors, flush);
+    return;
+  }
+#endif
+  writeFilesPosix(files, errors, flush);
 }
 
-// Function to check if file format is already compressed
-bool isAlreadyCompressed(const std::string& filename, const std::string& content_type) {
-  // Check by file extension
-  std::string lower_filename = filename;
-  std::transform(lower_filename.begin(), lower_filename.end(), lower_filename.begin(), ::tolower);
+// Output queued for the I/O pool is bounded, so compression cannot run far ahead of storage
+const size_t kMaxQueuedIoBytes = 256 * 1024 * 1024;
+// I/O threads started for --io-threads=auto, of which only the tuned limit run at once
+const int kMaxAutoIoThreads = 32;
+const int kIoTuneInterval = 256;  // Messages between two auto-tune decisions
+// Messages of one CPU worker are handed to the I/O pool in batches of
+// options.io_batch_messages messages or of this many bytes, whichever fills first, so
+// one io_uring submission and one group sync cover many files
+const size_t kIoBatchBytes = 8 * 1024 * 1024;
+
+// Carries out the file operations of each message on a pool of I/O threads, separate
+// from the CPU workers, so threads blocked in open() and write() never hold up parsing
+// and compression; with no I/O threads, batches run on the CPU worker that filled them.
+// Each CPU worker collects its messages into a batch, and the files of a batch are
+// written together (see writeFiles) and, unless --durability=none, synced as a group
+// before the batch's messages are journaled. With --io-threads=auto, the number of I/O
+// threads allowed to run at once follows Little's law: batches handed over per second
+// times the measured time to write one, plus 25% headroom, re-evaluated every
+// kIoTuneInterval messages.
+class IoStage {
+ public:
+  IoStage(int threads, bool auto_tune, int first_worker)
+      : pool_(threads > 0 ? std::make_unique<WorkStealingPool>(threads, first_worker) : nullptr),
+        auto_tune_(auto_tune), max_limit_(threads), batches_(first_worker),
+        limit_(auto_tune ? std::min(4, threads) : threads), lowest_limit_(limit_), highest_limit_(limit_),
+        window_start_(std::chrono::steady_clock::now()) {}
   
-  // Image formats (already compressed)
-  if (lower_filename.ends_with(".jpg") || lower_filename.ends_with(".jpeg") ||
-      lower_filename.ends_with(".png") || lower_filename.ends_with(".gif") ||
-      lower_filename.ends_with(".webp") || lower_filename.ends_with(".bmp")) {
-    return true;
+  // Function to queue the operations of one message; on_success runs on the I/O thread
+  // after all of them succeeded
+  void submit(FileOps ops, std::string what, std::function<void()> on_success) {
+    Batch& batch = batches_[current_worker];
+    batch.bytes += ops.bytes;
+    batch.messages.push_back({std::move(ops), std::move(what), std::move(on_success)});
+    size_t batch_messages = options.durability == kDurabilityStrict ? 1 : options.io_batch_messages;
+    if (batch.messages.size() >= batch_messages || batch.bytes >= kIoBatchBytes) {
+      dispatch(batch);
+    }
   }
   
-  // Archive formats (already compressed)
-  if (lower_filename.ends_with(".zip") || lower_filename.ends_with(".rar") ||
-      lower_filename.ends_with(".7z") || lower_filename.ends_with(".gz") ||
-      lower_filename.ends_with(".bz2") || lower_filename.ends_with(".xz")) {
-    return true;
+  // Function to hand over the partly filled batches and wait until everything is written;
+  // called once the CPU workers are idle
+  void waitIdle() {
+    for (auto& batch : batches_) {
+      if (!batch.messages.empty()) {
+        dispatch(batch);
+      }
+    }
+    if (pool_) {
+      pool_->waitIdle();
+    }
   }
   
-  // Video/Audio formats (already compressed)
-  if (lower_filename.ends_with(".mp4") || lower_filename.ends_with(".avi") ||
-      lower_filename.ends_with(".mkv") || lower_filename.ends_with(".mp3") ||
-      lower_filename.ends_with(".flac") || lower_filename.ends_with(".ogg")) {
-    return true;
+  std::string report() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::ostringstream out;
+    out << completed_ << " messages in " << batches_done_ << " batches, backend "
+        << (use_io_uring ? "io_uring" : "posix") << ", mean write time " << std::fixed << std::setprecision(2)
+        << (completed_ ? busy_seconds_ / completed_ * 1000 : 0) << " ms, ";
+    if (options.durability != kDurabilityNone) {
+      out << synced_files_ << " files flushed with " << synced_directories_ << " directory syncs, ";
+    }
+    if (!pool_) {
+      out << "on the CPU threads";
+    } else if (auto_tune_) {
+      out << "auto-tuned to " << limit_ << " of " << max_limit_ << " threads (range " << lowest_limit_ << "-"
+          << highest_limit_ << ")";
+    } else {
+      out << limit_ << " threads";
+    }
+    return out.str();
   }
   
-  // Check by content type
-  if (content_type.find("image/jpeg") != std::string::npos ||
-      content_type.find("image/png") != std::string::npos ||
-      content_type.find("image/gif") != std::string::npos ||
-      content_type.find("image/webp") != std::string::npos) {
-    return true;
-  }
+ private:
+  struct Message {
+    FileOps ops;
+    std::string what;
+    std::function<void()> on_success;
+  };
   
-  if (content_type.find("application/zip") != std::string::npos ||
-      content_type.find("application/x-zip") != std::string::npos ||
-      content_type.find("application/gzip") != std::string::npos) {
-    return true;
+  struct Batch {
+    std::vector<Message> messages;
+    size_t bytes = 0;
+  };
+  
+  void dispatch(Batch& pending) {
+    auto batch = std::make_shared<Batch>(std::move(pending));
+    pending = Batch();
+    if (!pool_) {
+      auto start = std::chrono::steady_clock::now();
+      run(*batch);
+      std::lock_guard<std::mutex> lock(mutex_);
+      completed_ += batch->messages.size();
+      batches_done_++;
+      busy_seconds_ += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      return;
+    }
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      // Only handed-over batches count against the bound, as they always drain; a batch
+      // larger than the bound is let through once the queue is empty
+      space_.wait(lock, [&] { return queued_bytes_ == 0 || queued_bytes_ + batch->bytes <= kMaxQueuedIoBytes; });
+      queued_bytes_ += batch->bytes;
+      window_submitted_++;
+    }
+    pool_->submit([this, batch] {
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        slot_.wait(lock, [this] { return active_ < limit_; });
+        active_++;
+      }
+      auto start = std::chrono::steady_clock::now();
+      run(*batch);
+      finished(batch->messages.size(), batch->bytes,
+               std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    });
   }
   
-  return false;
-}
-
-// Function to save attachments separately
-void saveAttachments(const Email& email, const std::string& output_dir, int email_count) {
-  for (size_t i = 0; i < email.attachments.size(); ++i) {
-    const auto& attachment = email.attachments[i];
-    
-    // Create attachment filename: email_NNNNNN_attachment_N_filename
-    std::ostringstream att_filename;
-    att_filename << "email_" << std::setfill('0') << std::setw(9) << email_count 
-                 << "_attachment_" << i << "_" << attachment.filename;
-    
-    std::string att_path = output_dir + "/attachments/" + att_filename.str();
-    
-    try {
-      // Check if format is already compressed
-      bool already_compressed = isAlreadyCompressed(attachment.filename, attachment.content_type);
-      
-      if (already_compressed) {
-        // Save directly without compression
-        std::ofstream att_file(att_path, std::ios::binary);
-        if (!att_file) {
-          throw std::runtime_error("Failed to create attachment file: " + att_path);
+  // Function to write the files of all messages in a batch, sync them, move them into
+  // place and make the links, sync the directories changed, then report each message whose
+  // operations all succeeded
+  void run(Batch& batch) {
+    bool sync = options.durability != kDurabilityNone;
+    std::vector<const FileOp*> files;
+    std::vector<size_t> owners;
+    for (size_t i = 0; i < batch.messages.size(); i++) {
+      for (const auto& op : batch.messages[i].ops.ops) {
+        if (op.kind == FileOp::kWrite) {
+          files.push_back(&op);
+          owners.push_back(i);
         }
-        
-        att_file.write(attachment.content.data(), attachment.content.size());
-        if (!att_file) {
-          throw std::runtime_error("Failed to write attachment data to: " + att_path);
+      }
+    }
+    std::vector<std::string> errors(files.size());
+    std::vector<bool> failed(batch.messages.size(), false);
+    try {
+      writeFiles(files, errors, fileFlush());
+    } catch (const std::exception& e) {
+      std::fill(errors.begin(), errors.end(), e.what());
+    }
+    for (size_t i = 0; i < files.size(); i++) {
+      if (!errors[i].empty() && !failed[owners[i]]) {
+        std::cerr << "Error saving " << batch.messages[owners[i]].what << ": " << errors[i] << std::endl;
+        failed[owners[i]] = true;
+      }
+    }
+    // Directories that got new entries, open ones and ones known by path
+    std::set<const OutputDirectory*> open_directories;
+    std::set<std::string> directories;
+    for (size_t i = 0; i < batch.messages.size(); i++) {
+      if (failed[i]) {
+        continue;
+      }
+      try {
+        for (const auto& op : batch.messages[i].ops.ops) {
+          if (op.kind == FileOp::kWrite && op.target_dir != nullptr) {
+            if (renameat(op.dir->fd, op.path.c_str(), op.target_dir->fd, op.target.c_str()) != 0) {
+              throw std::runtime_error("Failed to move " + op.fullPath() + " into " + op.target_dir->path + ": " +
+                                       strerror(errno));
+            }
+            open_directories.insert(op.target_dir);
+            continue;
+          }
+          if (op.kind == FileOp::kWrite && !op.target.empty()) {
+            fs::rename(op.path, op.target);
+          } else if (op.kind == FileOp::kLink) {
+            fs::remove(op.path);
+            fs::create_hard_link(op.target, op.path);
+          }
+          if (op.dir != nullptr) {
+            open_directories.insert(op.dir);
+          } else {
+            const std::string& name = op.kind == FileOp::kWrite && !op.target.empty() ? op.target : op.path;
+            directories.insert(fs::path(name).parent_path().string());
+          }
         }
-        
-      } else {
-        // Compress the attachment content
-        std::string compressed_content = compressGzip(attachment.content);
-        
-        std::ofstream att_file(att_path + ".gz", std::ios::binary);
-        if (!att_file) {
-          throw std::runtime_error("Failed to create attachment file: " + att_path);
+      } catch (const std::exception& e) {
+        std::cerr << "Error saving " << batch.messages[i].what << ": " << e.what() << std::endl;
+        failed[i] = true;
+      }
+    }
+    // The barrier of the batch: the files were synced above, and these fsyncs commit their
+    // new directory entries
+    if (sync) {
+      try {
+        for (const OutputDirectory* directory : open_directories) {
+          if (fsync(directory->fd) != 0) {
+            throw std::runtime_error("Failed to sync " + directory->path + ": " + strerror(errno));
+          }
         }
-        
-        att_file.write(compressed_content.data(), compressed_content.size());
-        if (!att_file) {
-          throw std::runtime_error("Failed to write attachment data to: " + att_path);
+        for (const auto& directory : directories) {
+          syncPath(directory);
         }
+      } catch (const std::exception& e) {
+        // Nothing in the batch is known to be durable
+        std::cerr << "Error saving batch of " << batch.messages.size() << " messages: " << e.what() << std::endl;
+        return;
       }
-      
+      std::lock_guard<std::mutex> lock(mutex_);
+      synced_files_ += files.size();
+      synced_directories_ += open_directories.size() + directories.size();
+    }
+    for (size_t i = 0; i < batch.messages.size(); i++) {
+      if (failed[i]) {
+        continue;
+      }
+      try {
+        batch.messages[i].on_success();
+      } catch (const std::exception& e) {
+        std::cerr << "Error saving " << batch.messages[i].what << ": " << e.what() << std::endl;
+      }
+    }
+  }
+  
+  void finished(size_t messages, size_t bytes, double seconds) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    active_--;
+    queued_bytes_ -= bytes;
+    completed_ += messages;
+    batches_done_++;
+    busy_seconds_ += seconds;
+    if (auto_tune_) {
+      window_seconds_ += seconds;
+      window_done_++;
+      window_messages_ += messages;
+      if (window_messages_ >= kIoTuneInterval) {
+        retune();
+      }
+    }
+    slot_.notify_all();
+    space_.notify_all();
+  }
+  
+  void retune() {
+    auto now = std::chrono::steady_clock::now();
+    double elapsed = std::chrono::duration<double>(now - window_start_).count();
+    if (elapsed > 0) {
+      double arrival_rate = window_submitted_ / elapsed;
+      double mean_latency = window_seconds_ / window_done_;
+      int wanted = static_cast<int>(std::ceil(arrival_rate * mean_latency * 1.25));
+      limit_ = std::clamp(wanted, 1, max_limit_);
+      lowest_limit_ = std::min(lowest_limit_, limit_);
+      highest_limit_ = std::max(highest_limit_, limit_);
+    }
+    window_start_ = now;
+    window_submitted_ = 0;
+    window_done_ = 0;
+    window_messages_ = 0;
+    window_seconds_ = 0;
+  }
+  
+  std::unique_ptr<WorkStealingPool> pool_;  // Null to run batches on the CPU workers
+  bool auto_tune_;
+  int max_limit_;
+  std::vector<Batch> batches_;  // Filling batch of each CPU worker
+  std::mutex mutex_;
+  std::condition_variable slot_;
+  std::condition_variable space_;
+  int limit_;
+  int lowest_limit_;
+  int highest_limit_;
+  int active_ = 0;
+  size_t queued_bytes_ = 0;
+  long completed_ = 0;
+  long batches_done_ = 0;
+  double busy_seconds_ = 0;
+  long synced_files_ = 0;
+  long synced_directories_ = 0;
+  std::chrono::steady_clock::time_point window_start_;
+  long window_submitted_ = 0;
+  long window_done_ = 0;
+  long window_messages_ = 0;
+  double window_seconds_ = 0;
+};
+
+IoStage* io_stage = nullptr;
+
+// Function to save one email on the current worker. Outside --tar, the encoded files are
+// handed to the I/O stage and the message is journaled once they are written and synced.
+void processEmail(const Email& email, const std::string& output_dir, const std::string& chunk_name) {
+  FileOps ops;
+  deferred_file_ops = io_stage != nullptr ? &ops : nullptr;
+  bool saved = saveEmail(email, output_dir, email.number);
+  deferred_file_ops = nullptr;
+  if (saved && options.metadata_index) {
+    metadata_buffers[current_worker].push_back(describeMessage(email, chunk_name, email.number));
+  }
+  
+  // Packed attachments are only indexed when their chunk completes, so with --pack
+  // progress is journaled per chunk
+  bool journaled = saved && journal.isOpen() && !options.pack_attachments;
+  // A copy kept by --dedup-messages is linked under the labels of its dropped copies later
+  std::optional<std::pair<uint64_t, KeptCopy>> kept;
+  if (saved && options.label_folders && options.dedup_messages) {
+    kept.emplace(email.fingerprint, KeptCopy{output_dir + "/" + messagePath(email, email.number), email.labels});
+  }
+  bool delivered = saved && options.incremental;
+  auto record = [journaled, chunk_name, offset = email.source_offset, number = email.number, kept, delivered,
+                 fingerprint = email.fingerprint] {
+    if (journaled) {
+      journal.recordMessage(chunk_name, offset, number);
+    }
+    // Only messages actually written are skipped by the next --incremental run
+    if (delivered) {
+      delivered_messages.insert(fingerprint);
+    }
+    if (kept) {
+      std::lock_guard<std::mutex> lock(label_merge_mutex);
+      kept_copies.insert(*kept);
+    }
+  };
+  if (io_stage != nullptr) {
+    io_stage->submit(std::move(ops), "email " + std::to_string(email.number), record);
+  } else {
+    try {
+      record();
     } catch (const std::exception& e) {
-      std::cerr << "Error saving attachment " << i << " for email " << email_count 
-                << ": " << e.what() << std::endl;
+      std::cerr << "Error saving email " << email.number << ": " << e.what() << std::endl;
     }
   }
 }
 
-// Function to save an email to an uncompressed .eml file in Maildir cur directory
-void saveEmail(const Email& email, const std::string& output_dir, int email_count) {
-  std::string maildir_filename = generateMaildirFilename(email, email_count);
-  std::string filename = output_dir + "/cur/" + maildir_filename;
-  
-  try {
-    // Save the stripped email content
-  std::ofstream outfile(filename);
-    if (!outfile) {
-      throw std::runtime_error("Failed to create output file: " + filename);
+// Function to link the kept copy of each message dropped by --dedup-messages into the
+// label folders of the dropped copies. Runs once a chunk is saved, when every kept copy
+// of its messages is on disk: the first copy seen is the one kept. The links go through
+// the I/O stage like any other label link, so they are synced with their folders; the
+// caller waits for them before the chunk is journaled as complete.
+void linkMergedLabels(const std::string& output_dir) {
+  std::lock_guard<std::mutex> lock(label_merge_mutex);
+  for (const auto& [fingerprint, labels] : merged_labels) {
+    auto kept = kept_copies.find(fingerprint);
+    if (kept == kept_copies.end()) {
+      continue;  // The kept copy failed to save, or was converted by an earlier run
     }
-    
-  outfile << email.content;
-    if (!outfile) {
-      throw std::runtime_error("Failed to write email data to: " + filename);
+    std::vector<std::string> added;
+    for (const auto& label : labels) {
+      if (std::find(kept->second.labels.begin(), kept->second.labels.end(), label) == kept->second.labels.end()) {
+        kept->second.labels.push_back(label);
+        added.push_back(label);
+      }
     }
-    
-    // Save attachments separately if any exist
-    if (!email.attachments.empty()) {
-      saveAttachments(email, output_dir, email_count);
+    if (added.empty()) {
+      continue;
+    }
+    FileOps ops;
+    deferred_file_ops = io_stage != nullptr ? &ops : nullptr;
+    linkIntoLabelFolders(added, output_dir, kept->second.path);
+    deferred_file_ops = nullptr;
+    if (io_stage != nullptr) {
+      io_stage->submit(std::move(ops), "label links of " + kept->second.path, [] {});
     }
-    
-  } catch (const std::exception& e) {
-    std::cerr << "Error saving email " << email_count << ": " << e.what() << std::endl;
   }
+  merged_labels.clear();
 }
 
-// Worker thread function to process emails
-void workerThread(const std::vector<Email>& emails, const std::string& output_dir, 
-                  int start_index, int end_index, int& global_counter, std::mutex& counter_mutex) {
-  for (int i = start_index; i < end_index; ++i) {
-    // Get email number under minimal lock
-    int email_number;
-    {
-      std::lock_guard<std::mutex> lock(counter_mutex);
-      email_number = global_counter++;
+// Memory figures from /proc, in kB (0 where unavailable)
+struct MemoryUsage {
+  long rss_kb = 0;
+  long peak_rss_kb = 0;
+  long page_cache_kb = 0;
+  long dirty_kb = 0;     // Page cache waiting to be written back, including pages under writeback
+};
+
+// Function to read a "Name:   value kB" field from the text of a /proc file
+long procField(const std::string& text, const std::string& name) {
+  size_t pos = text.find("\n" + name + ":");
+  if (pos == std::string::npos) {
+    return 0;
+  }
+  return std::atol(text.c_str() + pos + name.size() + 2);
+}
+
+// Function to sample the process's resident memory and the system's page cache
+MemoryUsage readMemoryUsage() {
+  auto slurp = [](const char* path) {
+    std::ifstream file(path);
+    std::ostringstream text;
+    text << "\n" << file.rdbuf();
+    return text.str();
+  };
+  std::string status = slurp("/proc/self/status");
+  std::string meminfo = slurp("/proc/meminfo");
+  MemoryUsage usage;
+  usage.rss_kb = procField(status, "VmRSS");
+  usage.peak_rss_kb = procField(status, "VmHWM");
+  usage.page_cache_kb = procField(meminfo, "Cached");
+  usage.dirty_kb = procField(meminfo, "Dirty") + procField(meminfo, "Writeback");
+  return usage;
+}
+
+// Function to format a size in kB as megabytes
+std::string megabytes(long kb) {
+  std::ostringstream out;
+  out << std::fixed << std::setprecision(1) << kb / 1024.0 << " MB";
+  return out.str();
+}
+
+// Function to print command-line usage
+void printUsage(const char* program) {
+  std::cerr << "mbox2eml: Extract individual email messages from chunked mbox files and save them as separate .eml files in Maildir format." << std::endl;
+  std::cerr << "Usage: " << program << " [options] <input_directory> <output_directory>" << std::endl;
+  std::cerr << "       " << program << " cat <saved_file>...      (write saved files to stdout, decompressed)" << std::endl;
+  std::cerr << "       " << program << " export <output_directory> (write all messages to stdout as an mbox)" << std::endl;
+  std::cerr << "       " << program << " extract <output_directory> <email_number> <attachment_index> | <content_hash>" << std::endl;
+  std::cerr << "                                  (write one packed attachment to stdout)" << std::endl;
+  std::cerr << "Input directory should contain files named: chunk_0.mbox, chunk_1.mbox, etc." << std::endl;
+  std::cerr << "Options:" << std::endl;
+  std::cerr << "  --dict    Train a shared dictionary on the first chunk and use it to compress" << std::endl;
+  std::cerr << "            small .eml bodies (.eml.zd) and small text attachments (.zd)" << std::endl;
+  std::cerr << "  --compress-bodies[=gzip]" << std::endl;
+  std::cerr << "            Save .eml bodies gzip-compressed (.eml.gz) for cold storage" << std::endl;
+  std::cerr << "  --dedup-attachments[=hardlink|manifest]" << std::endl;
+  std::cerr << "            Store each distinct attachment once under attachments/objects/ and" << std::endl;
+  std::cerr << "            hardlink occurrences to it, or list them in attachments/manifest.tsv" << std::endl;
+  std::cerr << "  --dedup-messages" << std::endl;
+  std::cerr << "            Save a message only once when it appears several times (by Message-ID," << std::endl;
+  std::cerr << "            or by content hash when it has none)" << std::endl;
+  std::cerr << "  --pack    Append attachments to per-thread attachments/pack-NNN.pack files indexed" << std::endl;
+  std::cerr << "            by attachments/pack.idx instead of writing one file per attachment" << std::endl;
+  std::cerr << "  --attachment-shards=N" << std::endl;
+  std::cerr << "            Spread attachments over N levels (1-3) of two-hex-digit subdirectories" << std::endl;
+  std::cerr << "  --mail-folders=year|N" << std::endl;
+  std::cerr << "            File messages into Maildir++ subfolders per year (.2019) or per N messages" << std::endl;
+  std::cerr << "  --label-folders" << std::endl;
+  std::cerr << "            Hardlink each message into a Maildir++ folder per X-Gmail-Labels label" << std::endl;
+  std::cerr << "  --labels=LABEL[,LABEL...]" << std::endl;
+  std::cerr << "            Only create folders for these labels (implies --label-folders)" << std::endl;
+  std::cerr << "  --tar=FILE|-" << std::endl;
+  std::cerr << "            Write the output tree as a tar stream to FILE or stdout instead of creating" << std::endl;
+  std::cerr << "            files; <output_directory> names the top-level directory in the archive" << std::endl;
+  std::cerr << "  --cpu-threads=N" << std::endl;
+  std::cerr << "            Number of threads parsing and compressing (default: one per CPU core);" << std::endl;
+  std::cerr << "            --threads=N is accepted too" << std::endl;
+  std::cerr << "  --io-threads=auto|N" << std::endl;
+  std::cerr << "            Threads creating and writing files: sized from measured write latency" << std::endl;
+  std::cerr << "            (default), a fixed count, or 0 to write on the CPU threads" << std::endl;
+  std::cerr << "  --io-backend=auto|uring|posix" << std::endl;
+  std::cerr << "            Write files on the I/O threads in batches through io_uring, or one by" << std::endl;
+  std::cerr << "            one; auto (default) uses io_uring when the kernel supports it" << std::endl;
+  std::cerr << "  --durability=none|batched[,N]|strict" << std::endl;
+  std::cerr << "            Write messages to tmp/ and rename them into cur/, syncing files and" << std::endl;
+  std::cerr << "            directories per batch of N messages (default 32) and per chunk, per" << std::endl;
+  std::cerr << "            message (strict), or not at all (none)" << std::endl;
+  std::cerr << "  --throttle=[read=RATE][,write=RATE][,files=N]" << std::endl;
+  std::cerr << "            Limit chunk reads and output writes to RATE bytes per second (K, M, G" << std::endl;
+  std::cerr << "            suffixes allowed) and file creation to N per second" << std::endl;
+  std::cerr << "  --throttle-file=PATH" << std::endl;
+  std::cerr << "            Read the limits (same syntax) from PATH, and again whenever it changes" << std::endl;
+  std::cerr << "            or the process receives SIGHUP" << std::endl;
+  std::cerr << "  --drop-input-cache" << std::endl;
+  std::cerr << "            Evict chunk file pages from the page cache once they have been read" << std::endl;
+  std::cerr << "  --drop-output-cache" << std::endl;
+  std::cerr << "            Start writeback of each output file at once and evict its pages when" << std::endl;
+  std::cerr << "            written, instead of leaving them dirty in the page cache" << std::endl;
+  std::cerr << "  --scheduler=stealing|static" << std::endl;
+  std::cerr << "            Schedule messages on a work-stealing pool (default), or split each chunk" << std::endl;
+  std::cerr << "            into equal-count slices, one thread each" << std::endl;
+  std::cerr << "  --big-messages=SIZE[,THREADS]" << std::endl;
+  std::cerr << "            Handle messages of at least SIZE bytes (K/M/G suffixes allowed) in a" << std::endl;
+  std::cerr << "            separate lane of THREADS threads (default 1)" << std::endl;
+  std::cerr << "  --index[=jsonl]" << std::endl;
+  std::cerr << "            Write a binary per-message metadata index to mbox2eml.index (and a JSON" << std::endl;
+  std::cerr << "            lines copy to mbox2eml.index.jsonl)" << std::endl;
+  std::cerr << "  --incremental" << std::endl;
+  std::cerr << "            Skip messages converted by earlier --incremental runs into the same output" << std::endl;
+  std::cerr << "            directory, tracked in mbox2eml.seen, and continue their email numbering" << std::endl;
+  std::cerr << "  --resume  Continue an interrupted run into the same output directory, skipping the" << std::endl;
+  std::cerr << "            chunks and messages recorded in its mbox2eml.journal" << std::endl;
+}
+
+// Function to parse options into the global options, collecting positional arguments
+bool parseOptions(int argc, char* argv[], std::vector<std::string>& positional) {
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (!arg.starts_with("--")) {
+      positional.push_back(arg);
+    } else if (arg == "--dict") {
+      options.use_dictionary = true;
+    } else if (arg == "--compress-bodies" || arg == "--compress-bodies=gzip") {
+      options.compress_bodies = true;
+    } else if (arg == "--dedup-attachments" || arg == "--dedup-attachments=hardlink") {
+      options.dedup_attachments = true;
+    } else if (arg == "--dedup-attachments=manifest") {
+      options.dedup_attachments = true;
+      options.dedup_manifest = true;
+    } else if (arg == "--dedup-messages") {
+      options.dedup_messages = true;
+    } else if (arg == "--pack") {
+      options.pack_attachments = true;
+    } else if (arg.starts_with("--attachment-shards=")) {
+      options.attachment_shard_levels = std::atoi(arg.c_str() + 20);
+      if (options.attachment_shard_levels < 1 || options.attachment_shard_levels > 3) {
+        std::cerr << "Error: --attachment-shards must be between 1 and 3" << std::endl;
+        return false;
+      }
+    } else if (arg == "--mail-folders=year") {
+      options.mail_folders_by_year = true;
+    } else if (arg.starts_with("--mail-folders=")) {
+      options.mail_folder_size = std::atoi(arg.c_str() + 15);
+      if (options.mail_folder_size <= 0) {
+        std::cerr << "Error: --mail-folders takes \"year\" or a positive message count" << std::endl;
+        return false;
+      }
+    } else if (arg == "--label-folders") {
+      options.label_folders = true;
+    } else if (arg.starts_with("--labels=")) {
+      options.label_folders = true;
+      std::istringstream labels(arg.substr(9));
+      std::string label;
+      while (std::getline(labels, label, ',')) {
+        if (!label.empty()) {
+          options.only_labels.insert(label);
+        }
+      }
+    } else if (arg.starts_with("--tar=")) {
+      options.tar_output = arg.substr(6);
+    } else if (arg.starts_with("--threads=") || arg.starts_with("--cpu-threads=")) {
+      options.threads = std::atoi(arg.c_str() + arg.find('=') + 1);
+      if (options.threads <= 0) {
+        std::cerr << "Error: --cpu-threads must be a positive number" << std::endl;
+        return false;
+      }
+    } else if (arg == "--io-threads=auto") {
+      options.io_auto = true;
+    } else if (arg.starts_with("--io-threads=")) {
+      options.io_auto = false;
+      options.io_threads = std::atoi(arg.c_str() + 13);
+      if (options.io_threads < 0 || arg.size() == 13) {
+        std::cerr << "Error: --io-threads takes \"auto\" or a thread count (0 to write on the CPU workers)" << std::endl;
+        return false;
+      }
+    } else if (arg == "--io-backend=auto" || arg == "--io-backend=uring" || arg == "--io-backend=posix") {
+      options.io_backend = arg.substr(13);
+    } else if (arg == "--durability=none" || arg == "--durability=strict") {
+      options.durability = arg == "--durability=none" ? kDurabilityNone : kDurabilityStrict;
+    } else if (arg == "--durability=batched" || arg.starts_with("--durability=batched,")) {
+      options.durability = kDurabilityBatched;
+      if (arg.size() > 20) {
+        options.io_batch_messages = std::atoi(arg.c_str() + 21);
+        if (options.io_batch_messages <= 0) {
+          std::cerr << "Error: --durability=batched,N takes a positive number of messages" << std::endl;
+          return false;
+        }
+      }
+    } else if (arg.starts_with("--throttle=")) {
+      options.throttle = arg.substr(11);
+      try {
+        parseThrottleLimits(options.throttle);
+      } catch (const std::exception& e) {
+        std::cerr << "Error: --throttle: " << e.what() << std::endl;
+        return false;
+      }
+    } else if (arg.starts_with("--throttle-file=")) {
+      options.throttle_file = arg.substr(16);
+    } else if (arg == "--drop-input-cache") {
+      options.drop_input_cache = true;
+    } else if (arg == "--drop-output-cache") {
+      options.drop_output_cache = true;
+    } else if (arg == "--scheduler=static" || arg == "--scheduler=stealing") {
+      options.static_scheduler = arg == "--scheduler=static";
+    } else if (arg.starts_with("--big-messages=")) {
+      char* end;
+      options.big_message_size = std::strtoull(arg.c_str() + 15, &end, 10);
+      switch (::tolower(*end)) {
+        case 'k': options.big_message_size <<= 10; end++; break;
+        case 'm': options.big_message_size <<= 20; end++; break;
+        case 'g': options.big_message_size <<= 30; end++; break;
+      }
+      if (*end == ',') {
+        options.big_message_threads = std::atoi(end + 1);
+        end += strlen(end);
+      }
+      if (options.big_message_size == 0 || options.big_message_threads <= 0 || *end != '\0') {
+        std::cerr << "Error: --big-messages takes a size such as 50M, optionally followed by ,THREADS" << std::endl;
+        return false;
+      }
+    } else if (arg == "--index" || arg == "--index=jsonl") {
+      options.metadata_index = true;
+      options.metadata_jsonl = arg == "--index=jsonl";
+    } else if (arg == "--incremental") {
+      options.incremental = true;
+    } else if (arg == "--resume") {
+      options.resume = true;
+    } else if (arg.starts_with("--compress-bodies=")) {
+      std::cerr << "Error: Unsupported body compression " << arg.substr(18) << " (this build supports gzip)" << std::endl;
+      return false;
+    } else {
+      std::cerr << "Error: Unknown option " << arg << std::endl;
+      return false;
     }
-    
-    // Do all the heavy work (compression, I/O) outside the lock
-    saveEmail(emails[i], output_dir, email_number);
-    
-    // Optional: uncomment for progress tracking (but adds lock contention)
-    // {
-    //   std::lock_guard<std::mutex> lock(counter_mutex);
-    //   std::cout << "Saved email_" << email_number << std::endl;
-    // }
   }
+  return true;
 }
 
 int main(int argc, char* argv[]) {
+  // Subcommand to read saved files back
+  if (argc >= 2 && std::string(argv[1]) == "cat") {
+    if (argc < 3) {
+      printUsage(argv[0]);
+      return 1;
+    }
+    return catFiles(std::vector<std::string>(argv + 2, argv + argc));
+  }
+  if (argc >= 2 && std::string(argv[1]) == "extract") {
+    if (argc != 4 && argc != 5) {
+      printUsage(argv[0]);
+      return 1;
+    }
+    return extractPackedAttachment(argv[2], std::vector<std::string>(argv + 3, argv + argc));
+  }
+  if (argc >= 2 && std::string(argv[1]) == "export") {
+    if (argc != 3) {
+      printUsage(argv[0]);
+      return 1;
+    }
+    return exportMessages(argv[2]);
+  }
+
   // Check for correct number of arguments
-  if (argc != 3) {
-    std::cerr << "mbox2eml: Extract individual email messages from chunked mbox files and save them as separate .eml files in Maildir format." << std::endl;
+  std::vector<std::string> positional;
+  if (!parseOptions(argc, argv, positional)) {
+    printUsage(argv[0]);
+    return 1;
+  }
+  if (positional.size() != 2) {
     std::cerr << "Error: Incorrect number of arguments." << std::endl;
-    std::cerr << "Usage: " << argv[0] << " <input_directory> <output_directory>" << std::endl;
-    std::cerr << "Input directory should contain files named: chunk_0.mbox, chunk_1.mbox, etc." << std::endl;
+    printUsage(argv[0]);
+    return 1;
+  }
+  if (options.static_scheduler && options.big_message_size > 0) {
+    std::cerr << "Error: --big-messages needs the work-stealing scheduler" << std::endl;
     return 1;
   }
 
-  std::string input_dir = argv[1];
-  std::string output_dir = argv[2];
+  std::string input_dir = positional[0];
+  std::string output_dir = positional[1];
+
+  // With --tar the output directory only names the top-level directory in the archive
+  int tar_fd = -1;
+  if (!options.tar_output.empty()) {
+    if (options.pack_attachments || options.resume || options.incremental) {
+      std::cerr << "Error: --pack, --resume and --incremental cannot be combined with --tar" << std::endl;
+      return 1;
+    }
+    if (options.tar_output == "-") {
+      tar_fd = STDOUT_FILENO;
+      std::cout.rdbuf(std::cerr.rdbuf()); // Keep progress messages out of the archive
+    } else {
+      tar_fd = open(options.tar_output.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (tar_fd < 0) {
+        std::cerr << "Error opening " << options.tar_output << ": " << strerror(errno) << std::endl;
+        return 1;
+      }
+    }
+    tar_writer = std::make_unique<TarWriter>(tar_fd, kTarMaxQueuedBytes);
+  }
 
   // Create Maildir structure in output directory
   try {
@@ -837,6 +5017,15 @@ int main(int argc, char* argv[]) {
     return 1;
   }
 
+  if (options.dedup_manifest && !tar_writer) {
+    std::string manifest_path = output_dir + "/attachments/manifest.tsv";
+    manifest_file.open(manifest_path, std::ios::app);
+    if (!manifest_file) {
+      std::cerr << "Error opening " << manifest_path << std::endl;
+      return 1;
+    }
+  }
+
   // Find all chunk files in the input directory
   std::vector<std::string> chunk_files = findChunkFiles(input_dir);
   if (chunk_files.empty()) {
@@ -848,57 +5037,345 @@ int main(int argc, char* argv[]) {
   std::cout << "Found " << chunk_files.size() << " chunk files to process." << std::endl;
 
   // Determine the number of threads to use (e.g., based on CPU cores)
-  int num_threads = std::thread::hardware_concurrency();
+  int num_threads = options.threads > 0 ? options.threads : std::thread::hardware_concurrency();
   if (num_threads == 0) {
     num_threads = 2; // Default to 2 threads if hardware concurrency is unknown
   }
+  std::unique_ptr<WorkStealingPool> pool;
+  std::unique_ptr<WorkStealingPool> big_pool;
+  int num_workers = num_threads;
+  if (!options.static_scheduler) {
+    pool = std::make_unique<WorkStealingPool>(num_threads);
+    work_pool = pool.get();
+    if (options.big_message_size > 0) {
+      big_pool = std::make_unique<WorkStealingPool>(options.big_message_threads, num_threads);
+      big_message_pool = big_pool.get();
+      num_workers += options.big_message_threads;
+    }
+  }
+  // File writes go to their own I/O threads, or in batches on the CPU threads with
+  // --io-threads=0; a tar stream already has its writer thread
+  std::unique_ptr<IoStage> io;
+  if (!tar_writer) {
+    io = std::make_unique<IoStage>(options.io_auto ? kMaxAutoIoThreads : options.io_threads, options.io_auto,
+                                   num_workers);
+    io_stage = io.get();
+    if (options.io_backend != "posix") {
+#ifdef HAVE_IO_URING
+      use_io_uring = UringWriter().init();
+#endif
+      if (!use_io_uring && options.io_backend == "uring") {
+        std::cerr << "Error: io_uring is not available on this system" << std::endl;
+        return 1;
+      }
+    }
+  }
 
-  std::mutex counter_mutex;
-  int global_email_counter = 0;
+  if (options.pack_attachments) {
+    try {
+      openPackWriters(output_dir, num_workers);
+    } catch (const std::exception& e) {
+      std::cerr << "Error opening packs: " << e.what() << std::endl;
+      return 1;
+    }
+  }
+  metadata_buffers.resize(num_workers);
+
+  // Open the journal, reading back an earlier run's progress with --resume
+  std::map<std::string, ChunkProgress> progress;
+  if (!tar_writer) {
+    std::string journal_path = output_dir + "/" + kJournalFilename;
+    try {
+      if (options.resume) {
+        progress = Journal::load(journal_path);
+      }
+      journal.open(journal_path, options.resume);
+    } catch (const std::exception& e) {
+      std::cerr << "Error opening journal: " << e.what() << std::endl;
+      return 1;
+    }
+  }
+
+  // Load the messages converted by earlier incremental runs; numbering continues after them
+  int next_email_number = 0;
+  if (options.incremental) {
+    try {
+      converted_messages.load(output_dir + "/" + kSeenFilename);
+    } catch (const std::exception& e) {
+      std::cerr << "Error loading seen messages: " << e.what() << std::endl;
+      return 1;
+    }
+    next_email_number = converted_messages.nextEmailNumber();
+    std::cout << "Skipping " << converted_messages.size() << " messages converted by earlier runs." << std::endl;
+  }
   int total_emails_processed = 0;
+  if (!options.throttle.empty()) {
+    applyThrottleLimits(parseThrottleLimits(options.throttle));
+  }
+  std::unique_ptr<ThrottleControl> throttle_control;
+  if (!options.throttle_file.empty()) {
+    throttle_control = std::make_unique<ThrottleControl>(options.throttle_file);
+  }
+  // Page cache and dirty pages are sampled after every chunk
+  MemoryUsage memory_at_start = readMemoryUsage();
+  long peak_page_cache_kb = memory_at_start.page_cache_kb;
+  long peak_dirty_kb = memory_at_start.dirty_kb;
+
+  // Function to journal a chunk record, if there is a journal; false when it cannot be written
+  auto journalChunk = [](const std::function<void()>& record) {
+    try {
+      if (journal.isOpen()) {
+        record();
+      }
+      return true;
+    } catch (const std::exception& e) {
+      std::cerr << "Error recording progress: " << e.what() << std::endl;
+      return false;
+    }
+  };
 
   // Process each chunk file sequentially to maintain order
   for (const std::string& chunk_file : chunk_files) {
-    std::cout << "Processing " << fs::path(chunk_file).filename().string() << "..." << std::endl;
-    
-    // Extract emails from current chunk
-    std::vector<Email> emails = extractEmails(chunk_file);
-    std::cout << "Extracted " << emails.size() << " emails from current chunk." << std::endl;
+    std::string chunk_name = fs::path(chunk_file).filename().string();
+    ChunkProgress& chunk_progress = progress[chunk_name];
     
-    if (emails.empty()) {
-      std::cout << "No emails found in " << fs::path(chunk_file).filename().string() << ", skipping." << std::endl;
+    if (chunk_progress.completed) {
+      std::cout << "Skipping " << chunk_name << ", completed by an earlier run." << std::endl;
+      next_email_number = chunk_progress.next_number;
+      if (options.dedup_messages || options.incremental) {
+        rememberMessages(chunk_file, chunk_progress);
+      }
       continue;
-  }
+    }
+    
+    std::cout << "Processing " << chunk_name << "..." << std::endl;
+    
+    // Extract emails from current chunk. Numbers are assigned here, in file order; a
+    // resumed chunk keeps the first number it was started with.
+    int first_number = chunk_progress.first_number >= 0 ? chunk_progress.first_number : next_email_number;
+    // Unless the whole chunk is needed first, to train the dictionary or to skip the
+    // messages saved by an interrupted run, the pool workers save each message as soon
+    // as they have parsed it
+    bool stream = work_pool != nullptr && chunk_progress.first_number < 0 &&
+                  !(options.use_dictionary && compression_dictionary.empty());
+    std::vector<Email> emails;
+    int count = 0;
+    if (stream) {
+      // The count is only known when the split is done, and is journaled again then
+      if (!journalChunk([&] { journal.recordChunkStart(chunk_name, first_number, -1); })) {
+        return 1;
+      }
+      splitAndParse(chunk_file, first_number, count, [&](const Email& email) {
+        processEmail(email, output_dir, chunk_name);
+      });
+      std::cout << "Extracted and saved " << count << " emails from current chunk." << std::endl;
+      next_email_number = first_number + count;
+      if (!journalChunk([&] { journal.recordChunkStart(chunk_name, first_number, count); })) {
+        return 1;
+      }
+    } else {
+      if (work_pool != nullptr) {
+        emails = splitAndParse(chunk_file, first_number, count);
+      } else {
+        std::vector<RawMessage> raw_messages = splitMessages(chunk_file, first_number);
+        std::vector<uint64_t> raw_sizes;
+        for (const auto& raw : raw_messages) {
+          raw_sizes.push_back(raw.content.size());
+        }
+        emails.resize(raw_messages.size());
+        runBatches(raw_sizes, num_threads, [&](int i) {
+          emails[i] = parseMessage(raw_messages[i]);
+          std::string().swap(raw_messages[i].content);
+        });
+      }
+      std::cout << "Extracted " << emails.size() << " emails from current chunk." << std::endl;
+      next_email_number = first_number + emails.size();
+    
+      // Resuming inside a chunk: drop the messages saved by the earlier run
+      if (chunk_progress.first_number >= 0) {
+        if (chunk_progress.count >= 0 && chunk_progress.count != static_cast<int>(emails.size())) {
+          std::cerr << "Error: " << chunk_name << " changed since the journaled run (" << chunk_progress.count
+                    << " emails then, " << emails.size() << " now)" << std::endl;
+          return 1;
+        }
+        std::vector<Email> remaining;
+        for (auto& email : emails) {
+          if (!chunk_progress.saved.count(email.source_offset)) {
+            remaining.push_back(std::move(email));
+            continue;
+          }
+          if (options.metadata_index) {
+            metadata_buffers[0].push_back(describeMessage(email, chunk_name, email.number));
+          }
+          if (options.incremental) {
+            delivered_messages.insert(email.fingerprint);
+          }
+          // Copies of it later in the chunk are linked under their labels again
+          if (options.label_folders && options.dedup_messages) {
+            std::lock_guard<std::mutex> lock(label_merge_mutex);
+            kept_copies.insert({email.fingerprint, {output_dir + "/" + messagePath(email, email.number), email.labels}});
+          }
+        }
+        std::cout << "Resuming " << chunk_name << ": " << emails.size() - remaining.size()
+                  << " emails already saved." << std::endl;
+        emails = std::move(remaining);
+      } else if (!journalChunk([&] { journal.recordChunkStart(chunk_name, first_number, emails.size()); })) {
+        return 1;
+      }
+    
+      if (emails.empty()) {
+        std::cout << "No emails found in " << chunk_name << ", skipping." << std::endl;
+        if (options.label_folders && options.dedup_messages) {
+          linkMergedLabels(output_dir);
+          if (io_stage != nullptr) {
+            io_stage->waitIdle();
+          }
+        }
+        if (!journalChunk([&] { journal.recordChunkDone(chunk_name, next_email_number); })) {
+          return 1;
+        }
+        continue;
+      }
 
-  // Calculate the number of emails per thread
-  int emails_per_thread = emails.size() / num_threads;
-  int remaining_emails = emails.size() % num_threads;
+      // Train (or reload) the shared dictionary from the first chunk before any file is saved
+      if (options.use_dictionary && compression_dictionary.empty()) {
+        try {
+          prepareDictionary(emails, output_dir);
+        } catch (const std::exception& e) {
+          std::cerr << "Error preparing dictionary: " << e.what() << std::endl;
+          return 1;
+        }
+      }
 
-    // Create and launch worker threads for current chunk
-  std::vector<std::thread> threads;
-  int start_index = 0;
+      std::vector<uint64_t> sizes;
+      for (const auto& email : emails) {
+        sizes.push_back(email.source_size);
+      }
+      runBatches(sizes, num_threads, [&](int i) {
+        processEmail(emails[i], output_dir, chunk_name);
+      });
+      count = emails.size();
+    }
+    if (io_stage != nullptr) {
+      io_stage->waitIdle();
+    }
+    if (options.label_folders && options.dedup_messages) {
+      linkMergedLabels(output_dir);
+      if (io_stage != nullptr) {
+        io_stage->waitIdle();
+      }
+    }
 
-  for (int i = 0; i < num_threads; ++i) {
-    int end_index = start_index + emails_per_thread;
-    if (i < remaining_emails) {
-      end_index++;
+    try {
+      if (options.pack_attachments) {
+        appendPackIndexLog(output_dir);
+      }
+      if (options.metadata_index && !tar_writer) {
+        appendMetadataLog(output_dir);
+      }
+      if (journal.isOpen()) {
+        journal.recordChunkDone(chunk_name, next_email_number);
+      }
+    } catch (const std::exception& e) {
+      std::cerr << "Error recording progress: " << e.what() << std::endl;
+      return 1;
     }
-    threads.emplace_back(workerThread, std::ref(emails), output_dir, start_index, end_index, 
-                           std::ref(global_email_counter), std::ref(counter_mutex));
-    start_index = end_index;
+
+    total_emails_processed += count;
+    std::cout << "Completed processing " << chunk_name 
+              << " (" << count << " emails)" << std::endl;
+    MemoryUsage memory = readMemoryUsage();
+    peak_page_cache_kb = std::max(peak_page_cache_kb, memory.page_cache_kb);
+    peak_dirty_kb = std::max(peak_dirty_kb, memory.dirty_kb);
   }
 
-    // Wait for all threads to finish processing current chunk
-  for (auto& thread : threads) {
-    thread.join();
+  if (options.pack_attachments) {
+    try {
+      writePackIndex(output_dir);
+    } catch (const std::exception& e) {
+      std::cerr << "Error writing pack index: " << e.what() << std::endl;
+      return 1;
+    }
+  }
+
+  if (options.metadata_index) {
+    try {
+      writeMetadataIndex(output_dir);
+    } catch (const std::exception& e) {
+      std::cerr << "Error writing metadata index: " << e.what() << std::endl;
+      return 1;
+    }
+  }
+
+  if (options.incremental) {
+    try {
+      converted_messages.save(output_dir + "/" + kSeenFilename, delivered_messages.values(), next_email_number);
+    } catch (const std::exception& e) {
+      std::cerr << "Error writing seen messages: " << e.what() << std::endl;
+      return 1;
+    }
   }
 
-    total_emails_processed += emails.size();
-    std::cout << "Completed processing " << fs::path(chunk_file).filename().string() 
-              << " (" << emails.size() << " emails)" << std::endl;
+  if (tar_writer) {
+    try {
+      if (options.dedup_manifest) {
+        writeOutputFile(output_dir + "/attachments/manifest.tsv", manifest_buffer.str());
+      }
+      tar_writer->finish();
+      if (tar_fd != STDOUT_FILENO && close(tar_fd) != 0) {
+        throw std::runtime_error(strerror(errno));
+      }
+    } catch (const std::exception& e) {
+      std::cerr << "Error finishing tar stream: " << e.what() << std::endl;
+      return 1;
+    }
   }
 
   std::cout << "Finished processing all " << chunk_files.size() << " chunks." << std::endl;
   std::cout << "Total emails processed: " << total_emails_processed << std::endl;
+  MemoryUsage memory_at_end = readMemoryUsage();
+  std::cout << "Memory: RSS " << megabytes(memory_at_end.rss_kb) << " (peak " << megabytes(memory_at_end.peak_rss_kb)
+            << "), page cache " << megabytes(memory_at_start.page_cache_kb) << " at start, "
+            << megabytes(memory_at_end.page_cache_kb) << " at end (peak "
+            << megabytes(std::max(peak_page_cache_kb, memory_at_end.page_cache_kb)) << "), dirty pages peak "
+            << megabytes(peak_dirty_kb) << std::endl;
+  if (options.drop_input_cache || options.drop_output_cache) {
+    std::cout << "Page cache dropped: " << megabytes(input_bytes_dropped / 1024) << " of input, "
+              << output_files_dropped << " output files" << std::endl;
+  }
+  if (work_pool != nullptr) {
+    std::cout << "Pool tasks stolen by idle workers: " << work_pool->tasksStolen() << std::endl;
+  }
+  std::cout << "Attachment blocks compressed by helper threads: " << compress_blocks_helped << std::endl;
+  if (io_stage != nullptr) {
+    std::cout << "I/O pool: " << io_stage->report() << std::endl;
+  }
+  if (options.label_folders) {
+    std::cout << "Label folder links created: " << label_links_created << std::endl;
+  }
+  if (options.dedup_messages) {
+    std::cout << "Duplicate messages dropped: " << duplicate_messages_dropped << std::endl;
+  }
+  if (options.incremental) {
+    std::cout << "Messages already converted: " << already_converted_dropped << std::endl;
+  }
+  if (read_limiter.everLimited() || write_limiter.everLimited() || file_limiter.everLimited()) {
+    std::ostringstream waited;
+    waited << std::fixed << std::setprecision(1) << read_limiter.waitedSeconds() << " s for reads, "
+           << write_limiter.waitedSeconds() << " s for writes, " << file_limiter.waitedSeconds()
+           << " s for file creation";
+    std::cout << "Throttled: waited " << waited.str() << " (summed over threads)" << std::endl;
+  }
+  std::cout << "Attachment compression decisions:" << std::endl;
+  for (int rule = 0; rule < kNumCompressionRules; ++rule) {
+    std::cout << "  " << kCompressionRuleNames[rule] << ": " << compression_rule_counts[rule] << std::endl;
+  }
+  if (options.dedup_attachments) {
+    std::cout << "Deduplicated attachments: " << dedup_occurrences << " occurrences stored as "
+              << dedup_unique_blobs << " blobs (" << dedup_bytes_saved << " bytes not rewritten)" << std::endl;
+  }
+  if (options.use_dictionary) {
+    std::cout << "Dictionary-compressed files: " << dictionary_compressed_files << std::endl;
+  }
   return 0;
 }
@@ -0,0 +1,102 @@
+#!/usr/bin/env python3
+"""Generate a synthetic Google Takeout style export (chunk_0.mbox, chunk_1.mbox, ...)
+for the tests and benchmarks. The output only depends on the arguments."""
+import argparse
+import base64
+import os
+import random
+
+LABELS = ["Inbox", "Sent", "Important", "Work/Projects", "Category Updates", "Opened"]
+
+
+def b64(data):
+    text = base64.b64encode(data).decode()
+    return "\n".join(text[i:i + 76] for i in range(0, len(text), 76))
+
+
+def attachment(name, content_type, data):
+    return (f"--BOUND\nContent-Type: {content_type}; name=\"{name}\"\n"
+            f"Content-Disposition: attachment; filename=\"{name}\"\n"
+            f"Content-Transfer-Encoding: base64\n\n{b64(data)}\n")
+
+
+def text_block(rng, size):
+    words = ["report", "meeting", "invoice", "weekly", "update", "status", "draft", "budget", "plan"]
+    lines = []
+    while size > 0:
+        line = " ".join(rng.choice(words) for _ in range(10)) + "\n"
+        lines.append(line)
+        size -= len(line)
+    return "".join(lines)
+
+
+def message(rng, number, big):
+    # Every 13th message repeats the previous one under another label, as Takeout does
+    copy = number % 13 == 0 and number > 0
+    source = number - 1 if copy else number
+    local = random.Random(source)
+    labels = ",".join(rng.sample(LABELS, rng.randint(1, 3)))
+    parts = [f"From {1000 + source}@xxx Mon Jan {1 + source % 28:02d} 12:00:00 +0000 2024\n",
+             f"X-GM-THRID: {source}\nX-Gmail-Labels: {labels}\n"]
+    # Some messages have no Date header, so the From line date is used
+    if source % 11 != 0:
+        parts.append(f"Date: Mon, {1 + source % 28:02d} Jan {2010 + source % 14} "
+                     f"{source % 24:02d}:{source % 60:02d}:00 +0000\n")
+    # Some subjects are raw 8-bit: Latin-1 (the lone byte 0xe9) or UTF-8
+    accent = {5: " caf\udce9", 7: " café"}.get(source % 10, "")
+    parts.append(f"From: Person {source % 7} <p{source % 7}@example.com>\nTo: me@example.com\n"
+                 f"Subject: Message {source}{accent}\n")
+    if source % 9 != 0:
+        parts.append(f"Message-ID: <m{source}@example.com>\n")
+    parts.append("MIME-Version: 1.0\nContent-Type: multipart/mixed; boundary=\"BOUND\"\n\n")
+    parts.append("--BOUND\nContent-Type: text/plain; charset=\"utf-8\"\n\n")
+    parts.append(text_block(local, 200 + local.randint(0, 4000)))
+    kind = source % 6
+    if kind == 1:
+        parts.append(attachment("notes.txt", "text/plain", text_block(local, 20000).encode()))
+    elif kind == 2:
+        parts.append(attachment("photo.jpg", "image/jpeg", local.randbytes(30000)))
+    elif kind == 3:
+        parts.append(attachment("logo.png", "image/png", b"\x89PNG\r\n\x1a\n" + bytes(range(256)) * 8))
+        parts.append(attachment("data.bin", "application/octet-stream", local.randbytes(5000)))
+    elif kind == 4:
+        # The same attachment in many messages, for --dedup-attachments
+        parts.append(attachment("terms.pdf", "application/pdf", b"%PDF-1.4\n" + b"terms " * 3000))
+    if big:
+        parts.append(attachment("export.csv", "text/csv",
+                                text_block(local, big).encode()))
+    parts.append("--BOUND--\n\n")
+    return "".join(parts)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("output_directory")
+    parser.add_argument("--chunks", type=int, default=3, help="number of chunk files")
+    parser.add_argument("--messages", type=int, default=100, help="messages per chunk")
+    parser.add_argument("--big", type=int, default=0,
+                        help="number of messages per chunk with a large attachment")
+    parser.add_argument("--big-size", type=int, default=8 << 20,
+                        help="size of the large attachments in bytes")
+    parser.add_argument("--skew", action="store_true",
+                        help="put the large messages at the start of each chunk instead of spreading them")
+    parser.add_argument("--seed", type=int, default=1)
+    args = parser.parse_args()
+
+    os.makedirs(args.output_directory, exist_ok=True)
+    rng = random.Random(args.seed)
+    number = 0
+    for chunk in range(args.chunks):
+        if args.skew:
+            big = set(range(args.big))
+        else:
+            big = set(i * args.messages // max(args.big, 1) for i in range(args.big))
+        with open(os.path.join(args.output_directory, f"chunk_{chunk}.mbox"), "w",
+                  encoding="utf-8", errors="surrogateescape") as f:
+            for i in range(args.messages):
+                f.write(message(rng, number, args.big_size if i in big else 0))
+                number += 1
+
+
+if __name__ == "__main__":
+    main()
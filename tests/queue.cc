@@ -0,0 +1,46 @@
+// Close-race stress test for BoundedQueue: in every round a producer pushes a few items
+// and closes the queue while consumers are popping, so the last push often lands right
+// as a consumer finds the queue empty. Every pushed item must come out exactly once.
+//
+// Build and run with: make test
+#define main mbox2eml_main
+#include "../mbox2eml.cc"
+#undef main
+
+int main(int argc, char* argv[]) {
+  int rounds = argc > 1 ? std::stoi(argv[1]) : 20000;
+  long lost = 0;
+  for (int round = 0; round < rounds; ++round) {
+    const int items = 1 + round % 4;
+    const int consumers = 1 + round % 3;
+    BoundedQueue<int> queue(4);
+    std::atomic<long> sum{0};
+    std::atomic<int> received{0};
+    std::vector<std::thread> threads;
+    for (int i = 0; i < consumers; ++i) {
+      threads.emplace_back([&] {
+        int item;
+        while (queue.pop(item)) {
+          sum += item;
+          received++;
+        }
+      });
+    }
+    for (int i = 1; i <= items; ++i) {
+      queue.push(i);
+    }
+    queue.close();
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    if (received != items || sum != items * (items + 1) / 2) {
+      lost += items - received;
+    }
+  }
+  if (lost != 0) {
+    std::cout << "FAIL: BoundedQueue lost " << lost << " items in " << rounds << " close races" << std::endl;
+    return 1;
+  }
+  std::cout << "ok:   BoundedQueue delivered every item in " << rounds << " close races" << std::endl;
+  return 0;
+}
@@ -0,0 +1,128 @@
+#!/bin/sh
+# Checks that the output does not depend on the number of threads or the scheduler:
+# converts a generated corpus with one thread, then with several threads and the other
+# scheduling modes, and compares the output trees byte for byte.
+#
+# Usage: tests/threads.sh [path/to/mbox2eml]
+set -eu
+
+BIN=${1:-./mbox2eml}
+THREADS=${THREADS:-4}
+TESTS=$(cd "$(dirname "$0")" && pwd)
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+python3 "$TESTS/corpus.py" "$WORK/in" --chunks=3 --messages=150 --big=1 --big-size=$((6 << 20))
+
+failed=0
+
+# Function to convert the corpus with the given options into $WORK/<name>
+convert() {
+  name=$1
+  shift
+  if ! "$BIN" "$@" "$WORK/in" "$WORK/$name" > "$WORK/$name.log" 2>&1; then
+    echo "FAIL: mbox2eml $* exited with an error:"
+    cat "$WORK/$name.log"
+    exit 1
+  fi
+}
+
+# Function to compare an output tree with the reference tree, leaving out the journal,
+# which records messages in the order they were saved
+compare() {
+  if diff -r -x mbox2eml.journal "$WORK/$1" "$WORK/$2" > "$WORK/$2.diff"; then
+    echo "ok:   $3"
+  else
+    echo "FAIL: $3"
+    head -20 "$WORK/$2.diff"
+    failed=1
+  fi
+}
+
+# Function to run one set of options with one thread and in the other modes
+check() {
+  set_name=$1
+  shift
+  convert "$set_name-1" --threads=1 "$@"
+  convert "$set_name-n" --threads="$THREADS" "$@"
+  compare "$set_name-1" "$set_name-n" "--threads=$THREADS${*:+ $*}"
+  convert "$set_name-static" --threads="$THREADS" --scheduler=static "$@"
+  compare "$set_name-1" "$set_name-static" "--threads=$THREADS --scheduler=static${*:+ $*}"
+  convert "$set_name-big" --threads="$THREADS" --big-messages=1M,2 "$@"
+  compare "$set_name-1" "$set_name-big" "--threads=$THREADS --big-messages=1M,2${*:+ $*}"
+  convert "$set_name-io" --threads="$THREADS" --io-threads=0 "$@"
+  compare "$set_name-1" "$set_name-io" "--threads=$THREADS --io-threads=0${*:+ $*}"
+}
+
+check plain
+# Names come from the message dates alone, whatever the converting host's time zone
+TZ=EST5EDT,M3.2.0,M11.1.0 convert plain-tz --threads="$THREADS"
+compare plain-1 plain-tz "TZ=EST5EDT --threads=$THREADS"
+check packed --compress-bodies --dedup-attachments --index=jsonl
+check folders --dedup-messages --label-folders --mail-folders=year --attachment-shards=2
+
+# The JSON index must parse even though some subjects are raw Latin-1
+if ! python3 - "$WORK/packed-1/mbox2eml.index.jsonl" <<'EOF'
+import json
+import sys
+
+entries = [json.loads(line) for line in open(sys.argv[1], encoding="utf-8")]
+subjects = {entry["email_number"]: entry["subject"] for entry in entries}
+if subjects.get(5) != "Message 5 caf\u00e9" or subjects.get(7) != "Message 7 caf\u00e9":
+    print(f"FAIL: 8-bit subjects not kept in the JSON index: {subjects.get(5)!r}, {subjects.get(7)!r}")
+    sys.exit(1)
+print(f"ok:   JSON index valid with 8-bit headers ({len(entries)} entries)")
+EOF
+then
+  failed=1
+fi
+
+# Message 13 of the corpus is dropped by --dedup-messages as a copy of message 12 under
+# other labels; the kept copy must be linked into the label folders of both
+if ! python3 - "$WORK/in/chunk_0.mbox" "$WORK/folders-1" <<'EOF'
+import glob
+import sys
+
+messages = open(sys.argv[1], errors="surrogateescape").read().split("\nFrom ")
+labels = set()
+for message in messages[12:14]:
+    header = next(line for line in message.split("\n") if line.startswith("X-Gmail-Labels: "))
+    labels.update(header[len("X-Gmail-Labels: "):].split(","))
+missing = [label for label in sorted(labels)
+           if not glob.glob(f"{sys.argv[2]}/.{label.replace('.', '_').replace('/', '.')}/cur/*.M12_*")]
+if missing:
+    print("FAIL: message 12 not linked under " + ", ".join(missing))
+    sys.exit(1)
+print(f"ok:   labels of a dropped copy merged into the kept one ({len(labels)} labels)")
+EOF
+then
+  failed=1
+fi
+
+# Message 0 of the corpus has no Date header, so its name takes the date of its Takeout
+# style From line, "Mon Jan 01 12:00:00 +0000 2024"
+if [ -f "$WORK/plain-1/cur/1704110400.M0_mbox2eml:2,S.eml" ]; then
+  echo "ok:   From line date used without a Date header"
+else
+  echo "FAIL: From line date not used for message 0:"
+  ls "$WORK/plain-1/cur" | grep '\.M0_'
+  failed=1
+fi
+
+# A large attachment parsed last in a streamed chunk must still be compressed on more
+# than one thread
+python3 "$TESTS/corpus.py" "$WORK/lone" --chunks=1 --messages=20 --big=1 --big-size=$((32 << 20))
+if ! "$BIN" --threads="$THREADS" "$WORK/lone" "$WORK/lone-out" > "$WORK/lone.log" 2>&1; then
+  echo "FAIL: mbox2eml --threads=$THREADS exited with an error:"
+  cat "$WORK/lone.log"
+  exit 1
+fi
+helped=$(sed -n 's/^Attachment blocks compressed by helper threads: //p' "$WORK/lone.log")
+if [ "${helped:-0}" -gt 0 ]; then
+  echo "ok:   large attachment compressed on several threads ($helped blocks by helpers)"
+else
+  echo "FAIL: large attachment compressed on one thread"
+  failed=1
+fi
+
+exit $failed